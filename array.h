@@ -0,0 +1,582 @@
+#ifndef NUA_ARRAY_H
+#define NUA_ARRAY_H
+
+// The array library works on the array part of tables, keys 0 up to
+// al.top, in bulk
+//   array.sum(t)		0 when empty
+//   array.min(t)		nil when empty, as is array.max(t)
+//   array.dot(a, b)		over the shorter of the two
+//   array.scale(t, k)		t[i] = t[i] * k
+//   array.add(a, b)		a[i] = a[i] + b[i], over the shorter
+//   array.fill(t, v[, n])	t[i] = v below n, or below al.top
+//   array.copy(dst, src)	dst[i] = src[i] below al.top of src
+//   array.prefix(t)		t[i] = t[0] + ... + t[i]
+// Arrays kept as doubles are worked on in place by the kernels below,
+// anything else goes element by element under the rules of the
+// instructions. Kernels add in a different order to a loop, so sums of
+// values that are not exact can differ in the last bits
+
+// Define NUA_NO_SIMD to only use the scalar kernels
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NUA_NO_SIMD)
+#define NUA_SIMD
+#include <immintrin.h>
+#endif
+
+typedef struct array_kernels {
+	double (*sum)(const double *a, size_t no);
+	// no must not be 0
+	double (*min)(const double *a, size_t no);
+	double (*max)(const double *a, size_t no);
+	double (*dot)(const double *a, const double *b, size_t no);
+	void (*scale)(double *a, size_t no, double k);
+	void (*add)(double *a, const double *b, size_t no);
+	void (*fill)(double *a, size_t no, double v);
+	void (*prefix)(double *a, size_t no);
+} array_kernels;
+
+static double array_sum_scalar(const double *a, size_t no) {
+	double s = 0;
+	for (size_t i = 0;i < no;++i) {
+		s += a[i];
+	}
+	return s;
+}
+
+static double array_min_scalar(const double *a, size_t no) {
+	double m = a[0];
+	for (size_t i = 1;i < no;++i) {
+		m = a[i] < m ? a[i] : m;
+	}
+	return m;
+}
+
+static double array_max_scalar(const double *a, size_t no) {
+	double m = a[0];
+	for (size_t i = 1;i < no;++i) {
+		m = a[i] > m ? a[i] : m;
+	}
+	return m;
+}
+
+static double array_dot_scalar(const double *a, const double *b, size_t no) {
+	double s = 0;
+	for (size_t i = 0;i < no;++i) {
+		s += a[i] * b[i];
+	}
+	return s;
+}
+
+static void array_scale_scalar(double *a, size_t no, double k) {
+	for (size_t i = 0;i < no;++i) {
+		a[i] *= k;
+	}
+}
+
+static void array_add_scalar(double *a, const double *b, size_t no) {
+	for (size_t i = 0;i < no;++i) {
+		a[i] += b[i];
+	}
+}
+
+static void array_fill_scalar(double *a, size_t no, double v) {
+	for (size_t i = 0;i < no;++i) {
+		a[i] = v;
+	}
+}
+
+static void array_prefix_scalar(double *a, size_t no) {
+	for (size_t i = 1;i < no;++i) {
+		a[i] += a[i - 1];
+	}
+}
+
+static const array_kernels array_scalar = {
+	array_sum_scalar, array_min_scalar, array_max_scalar, array_dot_scalar,
+	array_scale_scalar, array_add_scalar, array_fill_scalar, array_prefix_scalar,
+};
+
+#ifdef NUA_SIMD
+
+// SSE2 is always there on x86-64. Reductions keep two vectors going to
+// hide the latency of the adds, and what is left over past the last full
+// vector is done one at a time
+
+static double array_sum_sse2(const double *a, size_t no) {
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+		s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+	}
+	s0 = _mm_add_pd(s0, s1);
+	double s = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+	for (;i < no;++i) {
+		s += a[i];
+	}
+	return s;
+}
+
+static double array_min_sse2(const double *a, size_t no) {
+	__m128d m = _mm_set1_pd(a[0]);
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		m = _mm_min_pd(m, _mm_loadu_pd(a + i));
+	}
+	double r = _mm_cvtsd_f64(_mm_min_sd(m, _mm_unpackhi_pd(m, m)));
+	for (;i < no;++i) {
+		r = a[i] < r ? a[i] : r;
+	}
+	return r;
+}
+
+static double array_max_sse2(const double *a, size_t no) {
+	__m128d m = _mm_set1_pd(a[0]);
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		m = _mm_max_pd(m, _mm_loadu_pd(a + i));
+	}
+	double r = _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+	for (;i < no;++i) {
+		r = a[i] > r ? a[i] : r;
+	}
+	return r;
+}
+
+static double array_dot_sse2(const double *a, const double *b, size_t no) {
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+	}
+	s0 = _mm_add_pd(s0, s1);
+	double s = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+	for (;i < no;++i) {
+		s += a[i] * b[i];
+	}
+	return s;
+}
+
+static void array_scale_sse2(double *a, size_t no, double k) {
+	__m128d kv = _mm_set1_pd(k);
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		_mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), kv));
+	}
+	array_scale_scalar(a + i, no - i, k);
+}
+
+static void array_add_sse2(double *a, const double *b, size_t no) {
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		_mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	array_add_scalar(a + i, b + i, no - i);
+}
+
+static void array_fill_sse2(double *a, size_t no, double v) {
+	__m128d vv = _mm_set1_pd(v);
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		_mm_storeu_pd(a + i, vv);
+	}
+	array_fill_scalar(a + i, no - i, v);
+}
+
+// Each pair is summed within the vector, [x0, x0 + x1], then the total so
+// far is added to both
+static void array_prefix_sse2(double *a, size_t no) {
+	__m128d carry = _mm_setzero_pd();
+	size_t i = 0;
+	for (;i + 2 <= no;i += 2) {
+		__m128d x = _mm_loadu_pd(a + i);
+		x = _mm_add_pd(x, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8)));
+		x = _mm_add_pd(x, carry);
+		_mm_storeu_pd(a + i, x);
+		carry = _mm_unpackhi_pd(x, x);
+	}
+	if (i && i < no) {
+		a[i] += a[i - 1];
+	}
+}
+
+static const array_kernels array_sse2 = {
+	array_sum_sse2, array_min_sse2, array_max_sse2, array_dot_sse2,
+	array_scale_sse2, array_add_sse2, array_fill_sse2, array_prefix_sse2,
+};
+
+// AVX2 kernels are built for it whatever the flags, and only picked when
+// the CPU says it has it
+#define ARRAY_AVX2 __attribute__((target("avx2")))
+
+ARRAY_AVX2 static inline double array_hsum_avx2(__m256d v) {
+	__m128d h = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+ARRAY_AVX2 static double array_sum_avx2(const double *a, size_t no) {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (;i + 8 <= no;i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+		s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+	}
+	double s = array_hsum_avx2(_mm256_add_pd(s0, s1));
+	for (;i < no;++i) {
+		s += a[i];
+	}
+	return s;
+}
+
+ARRAY_AVX2 static double array_min_avx2(const double *a, size_t no) {
+	__m256d m = _mm256_set1_pd(a[0]);
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		m = _mm256_min_pd(m, _mm256_loadu_pd(a + i));
+	}
+	__m128d h = _mm_min_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+	double r = _mm_cvtsd_f64(_mm_min_sd(h, _mm_unpackhi_pd(h, h)));
+	for (;i < no;++i) {
+		r = a[i] < r ? a[i] : r;
+	}
+	return r;
+}
+
+ARRAY_AVX2 static double array_max_avx2(const double *a, size_t no) {
+	__m256d m = _mm256_set1_pd(a[0]);
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		m = _mm256_max_pd(m, _mm256_loadu_pd(a + i));
+	}
+	__m128d h = _mm_max_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+	double r = _mm_cvtsd_f64(_mm_max_sd(h, _mm_unpackhi_pd(h, h)));
+	for (;i < no;++i) {
+		r = a[i] > r ? a[i] : r;
+	}
+	return r;
+}
+
+ARRAY_AVX2 static double array_dot_avx2(const double *a, const double *b, size_t no) {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (;i + 8 <= no;i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+	double s = array_hsum_avx2(_mm256_add_pd(s0, s1));
+	for (;i < no;++i) {
+		s += a[i] * b[i];
+	}
+	return s;
+}
+
+ARRAY_AVX2 static void array_scale_avx2(double *a, size_t no, double k) {
+	__m256d kv = _mm256_set1_pd(k);
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		_mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), kv));
+	}
+	array_scale_scalar(a + i, no - i, k);
+}
+
+ARRAY_AVX2 static void array_add_avx2(double *a, const double *b, size_t no) {
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		_mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	}
+	array_add_scalar(a + i, b + i, no - i);
+}
+
+ARRAY_AVX2 static void array_fill_avx2(double *a, size_t no, double v) {
+	__m256d vv = _mm256_set1_pd(v);
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		_mm256_storeu_pd(a + i, vv);
+	}
+	array_fill_scalar(a + i, no - i, v);
+}
+
+// As for SSE2 in two steps, adding in the vector shifted along by one and
+// then by two lanes
+ARRAY_AVX2 static void array_prefix_avx2(double *a, size_t no) {
+	__m256d zero = _mm256_setzero_pd(), carry = zero;
+	size_t i = 0;
+	for (;i + 4 <= no;i += 4) {
+		__m256d x = _mm256_loadu_pd(a + i);
+		x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+		x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+		x = _mm256_add_pd(x, carry);
+		_mm256_storeu_pd(a + i, x);
+		carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	for (i = i ? i : 1;i < no;++i) {
+		a[i] += a[i - 1];
+	}
+}
+
+static const array_kernels array_avx2 = {
+	array_sum_avx2, array_min_avx2, array_max_avx2, array_dot_avx2,
+	array_scale_avx2, array_add_avx2, array_fill_avx2, array_prefix_avx2,
+};
+
+#endif
+
+static const array_kernels *array_k = &array_scalar;
+
+// Picks the widest kernels the CPU can run, up to level, 0 being scalar,
+// 1 SSE2 and 2 AVX2. Returns the level picked
+int nua_array_simd(int level) {
+	array_k = &array_scalar;
+#ifdef NUA_SIMD
+	if (level >= 2 && __builtin_cpu_supports("avx2")) {
+		array_k = &array_avx2;
+		return 2;
+	}
+	if (level >= 1) {
+		array_k = &array_sse2;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+// Double arrays the kernels can work on
+static inline int array_nums(tab *t) {
+	return t->kind == TAB_NUMS;
+}
+
+static int array_args(const char *name, int no_args, val *stack, int tabs) {
+	for (int i = 1;i <= tabs;++i) {
+		if (no_args < i || !IS_TAB(stack[i])) {
+			printf("array.%s needs %s!\n", name, tabs > 1 ? "two tables" : "a table");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int array_not_number(const char *name, val v) {
+	printf("array.%s needs numbers!\n", name);
+	print_val(v);
+	return -1;
+}
+
+int nua_array_sum(nua_state *n, int no_args, val *stack) {
+	if (array_args("sum", no_args, stack, 1)) {
+		return -1;
+	}
+	tab *t = AS_TAB(stack[1]);
+	if (array_nums(t)) {
+		stack[0] = NUM_VAL(array_k->sum(t->nums.items, t->al.top));
+		return 1;
+	}
+
+	val s = INT_VAL(0);
+	for (size_t i = 0;i < t->al.top;++i) {
+		if (!num_add(s, tab_al_get(t, i), &s)) {
+			return array_not_number("sum", tab_al_get(t, i));
+		}
+	}
+	stack[0] = s;
+	return 1;
+}
+
+// max picks the larger, otherwise the smaller
+static int array_min_max(int max, val *stack) {
+	const char *name = max ? "max" : "min";
+	tab *t = AS_TAB(stack[1]);
+	if (!t->al.top) {
+		stack[0] = NIL_VAL;
+		return 1;
+	}
+	if (array_nums(t)) {
+		stack[0] = NUM_VAL((max ? array_k->max : array_k->min)(t->nums.items, t->al.top));
+		return 1;
+	}
+
+	val m = tab_al_get(t, 0);
+	for (size_t i = 0;i < t->al.top;++i) {
+		val v = tab_al_get(t, i);
+		if (!IS_NUMBER(v)) {
+			return array_not_number(name, v);
+		}
+		if (max ? num_lt(m, v) : num_lt(v, m)) {
+			m = v;
+		}
+	}
+	stack[0] = m;
+	return 1;
+}
+
+int nua_array_min(nua_state *n, int no_args, val *stack) {
+	if (array_args("min", no_args, stack, 1)) {
+		return -1;
+	}
+	return array_min_max(0, stack);
+}
+
+int nua_array_max(nua_state *n, int no_args, val *stack) {
+	if (array_args("max", no_args, stack, 1)) {
+		return -1;
+	}
+	return array_min_max(1, stack);
+}
+
+int nua_array_dot(nua_state *n, int no_args, val *stack) {
+	if (array_args("dot", no_args, stack, 2)) {
+		return -1;
+	}
+	tab *a = AS_TAB(stack[1]), *b = AS_TAB(stack[2]);
+	size_t no = a->al.top < b->al.top ? a->al.top : b->al.top;
+	if (array_nums(a) && array_nums(b)) {
+		stack[0] = NUM_VAL(array_k->dot(a->nums.items, b->nums.items, no));
+		return 1;
+	}
+
+	val s = INT_VAL(0), p;
+	for (size_t i = 0;i < no;++i) {
+		if (!num_mul(tab_al_get(a, i), tab_al_get(b, i), &p)) {
+			return array_not_number("dot", IS_NUMBER(tab_al_get(a, i)) ? tab_al_get(b, i) : tab_al_get(a, i));
+		}
+		num_add(s, p, &s);
+	}
+	stack[0] = s;
+	return 1;
+}
+
+int nua_array_scale(nua_state *n, int no_args, val *stack) {
+	if (array_args("scale", no_args, stack, 1)) {
+		return -1;
+	}
+	tab *t = AS_TAB(stack[1]);
+	val k = no_args >= 2 ? stack[2] : NIL_VAL;
+	if (!IS_NUMBER(k)) {
+		return array_not_number("scale", k);
+	}
+	if (array_nums(t)) {
+		tab_own(t);
+		array_k->scale(t->nums.items, t->al.top, AS_NUMBER(k));
+		gc_tab_storage(&n->gc, t);
+		return 0;
+	}
+
+	for (size_t i = 0;i < t->al.top;++i) {
+		val v;
+		if (!num_mul(tab_al_get(t, i), k, &v)) {
+			return array_not_number("scale", tab_al_get(t, i));
+		}
+		tab_set(t, INT_VAL(i), v);
+	}
+	gc_tab_storage(&n->gc, t);
+	return 0;
+}
+
+int nua_array_add(nua_state *n, int no_args, val *stack) {
+	if (array_args("add", no_args, stack, 2)) {
+		return -1;
+	}
+	tab *a = AS_TAB(stack[1]), *b = AS_TAB(stack[2]);
+	size_t no = a->al.top < b->al.top ? a->al.top : b->al.top;
+	if (array_nums(a) && array_nums(b)) {
+		tab_own(a);
+		array_k->add(a->nums.items, b->nums.items, no);
+		gc_tab_storage(&n->gc, a);
+		return 0;
+	}
+
+	for (size_t i = 0;i < no;++i) {
+		val v;
+		if (!num_add(tab_al_get(a, i), tab_al_get(b, i), &v)) {
+			return array_not_number("add", IS_NUMBER(tab_al_get(a, i)) ? tab_al_get(b, i) : tab_al_get(a, i));
+		}
+		tab_set(a, INT_VAL(i), v);
+	}
+	gc_tab_storage(&n->gc, a);
+	return 0;
+}
+
+int nua_array_fill(nua_state *n, int no_args, val *stack) {
+	if (array_args("fill", no_args, stack, 1)) {
+		return -1;
+	}
+	tab *t = AS_TAB(stack[1]);
+	val v = no_args >= 2 ? stack[2] : NIL_VAL;
+	size_t no = t->al.top;
+	if (no_args >= 3) {
+		if (!IS_INT(stack[3]) || AS_INT(stack[3]) < 0) {
+			printf("array.fill needs a count of 0 or more!\n");
+			print_val(stack[3]);
+			return -1;
+		}
+		no = AS_INT(stack[3]);
+	}
+	if (array_nums(t) && IS_NUM(v) && no <= t->al.top) {
+		tab_own(t);
+		array_k->fill(t->nums.items, no, AS_NUM(v));
+		gc_tab_storage(&n->gc, t);
+		return 0;
+	}
+
+	for (size_t i = 0;i < no;++i) {
+		nua_tab_set(n, t, INT_VAL(i), v);
+	}
+	return 0;
+}
+
+int nua_array_copy(nua_state *n, int no_args, val *stack) {
+	if (array_args("copy", no_args, stack, 2)) {
+		return -1;
+	}
+	tab *dst = AS_TAB(stack[1]), *src = AS_TAB(stack[2]);
+	size_t no = src->al.top;
+	if (array_nums(dst) && array_nums(src) && no <= dst->al.top) {
+		tab_own(dst);
+		memmove(dst->nums.items, src->nums.items, no * sizeof(double));
+		gc_tab_storage(&n->gc, dst);
+	} else {
+		for (size_t i = 0;i < no;++i) {
+			nua_tab_set(n, dst, INT_VAL(i), tab_al_get(src, i));
+		}
+	}
+	stack[0] = TAB_VAL(dst);
+	return 1;
+}
+
+int nua_array_prefix(nua_state *n, int no_args, val *stack) {
+	if (array_args("prefix", no_args, stack, 1)) {
+		return -1;
+	}
+	tab *t = AS_TAB(stack[1]);
+	if (array_nums(t)) {
+		tab_own(t);
+		array_k->prefix(t->nums.items, t->al.top);
+		gc_tab_storage(&n->gc, t);
+		return 0;
+	}
+
+	val s = INT_VAL(0);
+	for (size_t i = 0;i < t->al.top;++i) {
+		if (!num_add(s, tab_al_get(t, i), &s)) {
+			return array_not_number("prefix", tab_al_get(t, i));
+		}
+		tab_set(t, INT_VAL(i), s);
+	}
+	gc_tab_storage(&n->gc, t);
+	return 0;
+}
+
+int nua_open_array(nua_state *n, tab *env) {
+	tab *a = nua_new_tab(n);
+	nua_set_field(n, a, "sum", FUNC_VAL(nua_new_c_func(n, &nua_array_sum)));
+	nua_set_field(n, a, "min", FUNC_VAL(nua_new_c_func(n, &nua_array_min)));
+	nua_set_field(n, a, "max", FUNC_VAL(nua_new_c_func(n, &nua_array_max)));
+	nua_set_field(n, a, "dot", FUNC_VAL(nua_new_c_func(n, &nua_array_dot)));
+	nua_set_field(n, a, "scale", FUNC_VAL(nua_new_c_func(n, &nua_array_scale)));
+	nua_set_field(n, a, "add", FUNC_VAL(nua_new_c_func(n, &nua_array_add)));
+	nua_set_field(n, a, "fill", FUNC_VAL(nua_new_c_func(n, &nua_array_fill)));
+	nua_set_field(n, a, "copy", FUNC_VAL(nua_new_c_func(n, &nua_array_copy)));
+	nua_set_field(n, a, "prefix", FUNC_VAL(nua_new_c_func(n, &nua_array_prefix)));
+	return nua_set_field(n, env, "array", TAB_VAL(a));
+}
+
+#endif
@@ -1,4 +1,5 @@
 CFLAGS="-Wall -Werror -g -Wno-unused-variable -O2 -Wno-unused-function -Wno-missing-braces -std=c11"
 LLIBS="-lm"
 
-cc $CFLAGS $LLIBS *.c -o nua
+cc $CFLAGS *.c $LLIBS -o nua
+cc $CFLAGS tools/heap_dom.c $LLIBS -o heap_dom
@@ -1,213 +1,850 @@
 #ifndef NUA_API
 #define NUA_API
 
+// The stack may not grow beyond this many values
+#define NUA_MAX_STACK (1 << 20)
+// Calls and loop iterations before a function is compiled to native code
+#define NUA_JIT_THRESHOLD 1000
+// Type misses after which an instruction is no longer quickened
+#define NUA_QUICK_MISSES 4
+
+// Calls between Nua functions push a frame rather than recursing in C
+typedef struct frame {
+	int base;		// Stack index of the caller
+	int pc;			// Of the call in the caller
+} frame;
+
+RH_AL_MAKE(frame_al, frame)
+
 typedef struct nua_state {
 	val_al stack;
+	frame_al frames;
 
 	// Mem management
 	size_t white;		// Current val of white tag (0, 1)
-	mem_block gc_list;	// All objects
+	gc_heap gc;		// All objects and collection pacing
 	str_map intern_map;
+
+	int jit_threshold;	// 0 never compiles
 } nua_state;
 
-void gc_mark(nua_state *n, int height) {
-	n->gc_list.colour = !n->gc_list.colour;
-	int white = n->gc_list.colour;
+// Only the stack and remembered set are roots, marking does not look into
+// the nursery
+void gc_minor(nua_state *n, int height) {
+	GC_STAT(uint64_t start = gc_clock_ns());
 
 	for (int i = 0;i < height+1;++i) {
-		gc_val_mark(&n->stack.items[i], !white);
+		gc_forward_val(&n->gc, &n->stack.items[i]);
 	}
+	gc_minor_finish(&n->gc);
+
+	GC_STAT(
+		uint64_t ns = gc_clock_ns() - start;
+		n->gc.stats.minors++;
+		n->gc.stats.minor_ns += ns;
+		gc_stat_pause(&n->gc, ns);
+	);
+}
+
+void gc_mark_roots(nua_state *n, int height) {
+	for (int i = 0;i < height+1;++i) {
+		gc_grey_val(&n->gc, &n->stack.items[i]);
+	}
+}
+
+// The stack has no barrier, so it is rescanned before the cycle can finish,
+// along with everything written to since it was scanned. The nursery is
+// emptied first, so that everything it holds is marked
+void gc_atomic(nua_state *n, int height) {
+	gc_minor(n, height);
+	gc_mark_roots(n, height);
+	while (n->gc.grey_again.top) {
+		gc_grey_list_push(&n->gc.grey, gc_grey_list_pop(&n->gc.grey_again));
+	}
+	gc_propagate(&n->gc, LONG_MAX);
+	gc_clear_interned(&n->gc, &n->intern_map);
+
+	// Everything still white is dead, and becomes the colour to sweep
+	n->gc.list.colour = !n->gc.list.colour;
+	gc_sweep_start(&n->gc);
+	n->gc.state = GC_SWEEP;
+}
+
+void gc_step(nua_state *n, int height, long budget) {
+	gc_heap *h = &n->gc;
+
+	if (h->state == GC_PAUSE) {
+		// Timed as a pause of its own
+		gc_minor(n, height);
+	}
+
+	GC_STAT(
+		uint64_t start = gc_clock_ns();
+		int state = h->state;
+	);
+
+	switch (h->state) {
+	case GC_PAUSE:
+		GC_STAT(h->stats.cycle = (gc_cycle_stats) {0});
+		gc_mark_roots(n, height);
+		h->state = GC_MARK;
+		break;
+	case GC_MARK:
+		if (gc_propagate(h, budget)) {
+			gc_atomic(n, height);
+		}
+		break;
+	case GC_SWEEP:
+		if (gc_sweep_step(h, budget)) {
+			h->state = GC_PAUSE;
+		}
+		break;
+	}
+
+	GC_STAT(
+		uint64_t ns = gc_clock_ns() - start;
+		if (state == GC_SWEEP) {
+			h->stats.cycle.sweep_ns += ns;
+		} else {
+			h->stats.cycle.mark_ns += ns;
+		}
+		gc_stat_pause(h, ns);
+
+		if (h->state == GC_PAUSE) {
+			h->stats.cycles++;
+			h->stats.last = h->stats.cycle;
+		}
+	);
+
+	if (h->state == GC_PAUSE) {
+		gc_set_threshold(h);
+	} else {
+		h->threshold = h->allocated + GC_STEP_SIZE;
+	}
+}
+
+// Finishes any cycle in progress, then runs a complete one
+void gc_full(nua_state *n, int height) {
+	while (n->gc.state != GC_PAUSE) {
+		gc_step(n, height, LONG_MAX);
+	}
+	do {
+		gc_step(n, height, LONG_MAX);
+	} while (n->gc.state != GC_PAUSE);
+}
+
+// Only does work once the nursery is full or the allocation debt since the
+// last step is due. Returns 1 if objects may have been moved
+static inline int gc_check(nua_state *n, int height) {
+	int collected = 0;
+
+	if (n->gc.young_end - n->gc.young_top < GC_NURSERY_RESERVE || n->gc.young_storage > GC_NURSERY_SIZE) {
+		gc_minor(n, height);
+		collected = 1;
+	}
+	if (n->gc.allocated >= n->gc.threshold) {
+		if (n->gc.emergency) {
+			// An allocation failed, see GC_RESERVE_SIZE
+			gc_full(n, height);
+			n->gc.emergency = 0;
+			n->gc.reserve = malloc(GC_RESERVE_SIZE);
+		} else {
+			// Minor collections promote a nursery at a time, so work is
+			// paid for all of what was allocated since the last step
+			long debt = n->gc.allocated - n->gc.threshold + GC_STEP_SIZE;
+			gc_step(n, height, debt / 100 * n->gc.stepmul);
+		}
+		collected = 1;
+	}
+
+	return collected;
 }
 
 int nua_call(nua_state *n, int arg_base, int no_args, int no_returns);
+
+// Threaded dispatch jumps straight from each instruction to the next through
+// a table of label addresses, rather than back through a single switch.
+// Define NUA_NO_COMPUTED_GOTO to always use the switch
+#if defined(__GNUC__) && !defined(NUA_NO_COMPUTED_GOTO)
+#define NUA_COMPUTED_GOTO
+#endif
+
+#ifdef NUA_COMPUTED_GOTO
+#define VM_CASE(OP) case OP_##OP: L_##OP
+#define VM_JUMP \
+	ins = f->def->ins.items[pc]; \
+	goto *dispatch[ins.op]
+#define VM_NEXT \
+	if (gc_check(n, base + f->def->gc_height.items[pc])) { \
+		f = AS_FUNC(n->stack.items[base]); \
+		env = f->env; \
+	} \
+	pc++; \
+	VM_JUMP
+#else
+#define VM_CASE(OP) case OP_##OP
+#define VM_JUMP continue
+#define VM_NEXT break
+#endif
+
+// Rewrites the instruction at pc into a quickened form, see op_generic
+#define VM_QUICKEN(OP) \
+	if (f->def->misses[pc] < NUA_QUICK_MISSES) { \
+		f->def->ins.items[pc].op = OP_##OP; \
+	}
+// Rewrites it back, and carries it out as the generic form
+#define VM_DEOPT(OP) \
+	f->def->misses[pc]++; \
+	f->def->ins.items[pc].op = OP_##OP; \
+	VM_JUMP
+
+#ifdef NUA_JIT
+// Moves over to native code at pc, once the function has some or becomes
+// hot by counting this entry
+#define VM_NATIVE if (jit_hot(n, f->def)) goto jit
+// As VM_NEXT, but continuing in native code where there is some
+#define VM_RESUME \
+	if (f->def->jit) { \
+		gc_check(n, base + f->def->gc_height.items[pc]); \
+		pc++; \
+		goto jit; \
+	} \
+	VM_NEXT
+#else
+#define VM_NATIVE
+#define VM_RESUME VM_NEXT
+#endif
+
+// Reloads the state of the function whose frame starts at base, needed
+// after any call or return as the stack may have moved
+#define VM_LOAD \
+	f = AS_FUNC(n->stack.items[base]); \
+	lit = f->def->literals.items; \
+	env = f->env; \
+	reg = &n->stack.items[base + 1]
+
 int nua_pcall(nua_state *n, int arg_base, int no_args, int no_returns);
 
 int nua_c_func(nua_state *n, int arg_base, int no_args, int no_returns);
 
-int nua_call(nua_state *n, int base, int no_args, int no_returns) {	
-	int pc = 0;
+// Grows the stack to hold size values, with nil in any new slots
+int nua_stack_reserve(nua_state *n, size_t size) {
+	if (size <= n->stack.size) {
+		return 0;
+	}
+	if (size > NUA_MAX_STACK) {
+		printf("Stack overflow!\n");
+		return -1;
+	}
+
+	size_t old = n->stack.size, new = old ? old : 1;
+	while (new < size) {
+		new *= 2;
+	}
+	val_al_resize(&n->stack, new);
+	memset(&n->stack.items[old], 0, (new - old) * sizeof(val));
+
+	return 0;
+}
 
-	func *f = n->stack.items[base].func;
-	val *lit = f->def->literals.items;
-	tab *env = f->env;
+// Makes room for the registers of the function at base, and pads the
+// arguments with nils
+static inline int nua_enter(nua_state *n, int base, int no_args) {
+	func_def *d = AS_FUNC(n->stack.items[base])->def;
+	size_t size = base + d->max_reg + 2;
+	if (size > n->stack.size && nua_stack_reserve(n, size)) {
+		return -1;
+	}
+
+	for (int i = no_args;i < d->no_args;++i) {
+		n->stack.items[base + 1 + i] = NIL_VAL;
+	}
+	return 0;
+}
 
-	size_t max = base + f->def->max_reg;
+// Numeric for loops keep the counter, limit and step in the registers from
+// r, followed by the variable seen by the body. The loop runs in integers
+// when all three start as integers, otherwise in doubles
 
-	if (max >= n->stack.size) {
-		size_t old = n->stack.size, new = n->stack.size * 2;
-		val_al_resize(&n->stack, new);
+// Gives whether the loop runs at all, or -1 if it can not be run
+static inline int for_prep(val *r) {
+	if (!IS_NUMBER(r[0]) || !IS_NUMBER(r[1]) || !IS_NUMBER(r[2])) {
+		return -1;
 	}
 
-	// MAY BE INVALIDATED DURING FUNCTION CALL DUE TO RESIZE
-	val *reg = &n->stack.items[base + 1];
+	int run;
+	if (IS_INT(r[0]) && IS_INT(r[1]) && IS_INT(r[2])) {
+		int64_t step = AS_INT(r[2]);
+		if (!step) {
+			return -1;
+		}
+		run = step > 0 ? AS_INT(r[0]) <= AS_INT(r[1]) : AS_INT(r[0]) >= AS_INT(r[1]);
+	} else {
+		for (int i = 0;i < 3;++i) {
+			r[i] = NUM_VAL(AS_NUMBER(r[i]));
+		}
+		double step = AS_NUM(r[2]);
+		if (step == 0) {
+			return -1;
+		}
+		run = step > 0 ? AS_NUM(r[0]) <= AS_NUM(r[1]) : AS_NUM(r[0]) >= AS_NUM(r[1]);
+	}
+
+	r[3] = r[0];
+	return run;
+}
 
-	for (int i = no_args;i < f->def->no_args;++i) {
-		reg[base + i + 1] = (val) { VAL_NIL };
+// Steps the counter, gives whether to go round again. Integer loops end
+// rather than overflow
+static inline int for_loop(val *r) {
+	if (IS_INT(r[0])) {
+		int64_t i, step = AS_INT(r[2]);
+		if (!int_add(AS_INT(r[0]), step, &i)
+		||  (step > 0 ? i > AS_INT(r[1]) : i < AS_INT(r[1]))) {
+			return 0;
+		}
+		// Both stored directly, copying r[0] would load it whole right after
+		// its parts were stored, which stalls
+		r[0] = INT_VAL(i);
+		r[3] = INT_VAL(i);
+		return 1;
 	}
 
+	double i = AS_NUM(r[0]) + AS_NUM(r[2]);
+	if (!(AS_NUM(r[2]) > 0 ? i <= AS_NUM(r[1]) : i >= AS_NUM(r[1]))) {
+		return 0;
+	}
+	r[0] = NUM_VAL(i);
+	r[3] = NUM_VAL(i);
+	return 1;
+}
+
+#include "jit.h"
+
+int nua_call(nua_state *n, int base, int no_args, int no_returns) {	
+	// Frames below belong to whoever called in, possibly a C function
+	size_t entry = n->frames.top;
+	int pc = 0;
+
+	func *f;
+	val *lit, *reg;
+	tab *env;
+
+	if (nua_enter(n, base, no_args)) {
+		return -1;
+	}
+	VM_LOAD;
+
+#ifdef NUA_COMPUTED_GOTO
+	static void *dispatch[OPCODE_NO] = {
+#define I(OP, ...) &&L_##OP
+OPCODES
+#undef I
+	};
+#endif
+
+	inst ins;
+	VM_NATIVE;
 	while (1) {
-		inst ins = f->def->ins.items[pc];
+		ins = f->def->ins.items[pc];
 		// printf("%d", pc);print_inst(ins);
 		switch (ins.op) {
-		case OP_COVER:	
+		VM_CASE(NOP):
+			VM_NEXT;
+		VM_CASE(COVER):
 			pc++;
-			if (reg[ins.reg].type != VAL_NIL) {
-				break;
-			} else {
-				ins = f->def->ins.items[pc];
-			} // fall through	
-		case OP_JMP:
+			if (!IS_NIL(reg[ins.reg])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			// fall through
+		VM_CASE(JMP):
 			pc += ins.off;
-			continue;	// Avoid addition at end of loop
-		case OP_NIL:
-			reg[ins.reg] = (val) {VAL_NIL};
-			break;
-		case OP_SETL:
-			switch (lit[ins.lit].type) {
+			if (ins.off < 0) {
+				VM_NATIVE;
+			}
+			VM_JUMP;	// Avoid addition at end of loop
+		VM_CASE(NIL):
+			reg[ins.reg] = NIL_VAL;
+			VM_NEXT;
+		VM_CASE(SETL):
+			switch (VAL_TYPE_OF(lit[ins.lit])) {
 			case VAL_TAB:
-				reg[ins.reg] = (val) {VAL_TAB, .tab = gc_alloc(&n->gc_list, sizeof(tab), GC_TAB)};
-				reg[ins.reg].tab->al = val_al_clone(&lit[ins.lit].tab->al);
-				reg[ins.reg].tab->ht = val_ht_clone(&lit[ins.lit].tab->ht);
+				reg[ins.reg] = TAB_VAL(gc_alloc_young(&n->gc, sizeof(tab), GC_TAB));
+				tab_share(AS_TAB(reg[ins.reg]), AS_TAB(lit[ins.lit]));
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.reg])->link, lit[ins.lit]);
 				break;
 			case VAL_FUNC:
-				reg[ins.reg] = (val) {VAL_FUNC, .func = gc_alloc(&n->gc_list, sizeof(func), GC_FUNC)};
-				reg[ins.reg].func->type = FUNC_NUA;
-				reg[ins.reg].func->def = lit[ins.lit].func->def;
-				reg[ins.reg].func->env = f->env;
+				reg[ins.reg] = FUNC_VAL(gc_alloc_young(&n->gc, sizeof(func), GC_FUNC));
+				AS_FUNC(reg[ins.reg])->type = FUNC_NUA;
+				AS_FUNC(reg[ins.reg])->def = AS_FUNC(lit[ins.lit])->def;
+				AS_FUNC(reg[ins.reg])->env = f->env;
 				break;
 			default:
 				reg[ins.reg] = lit[ins.lit];
 				break;
 			}
-			break;
-		case OP_CALL: {
-			if (reg[ins.rout].type != VAL_FUNC) {
+			VM_NEXT;
+		VM_CASE(CALL): {
+			if (!IS_FUNC(reg[ins.rout])) {
 				printf("Attempt to call non-function!\n");
 				print_val(reg[ins.rout]);
-				return -1;
+				goto error;
 			}
 			// OP is interpreted
 			// .rout = func register, and base of func args - 1, base of return vals
 			// .rina = no args, call has to pad with nils
 			// .rinb = no return vals, return has to pad with nils
-			int no_ret;
-			switch (reg[ins.rout].func->type) {
+			func *callee = AS_FUNC(reg[ins.rout]);
+			if (callee->type == FUNC_NUA) {
+				frame_al_push(&n->frames, (frame) {base, pc});
+				base += 1 + ins.rout;
+				if (nua_enter(n, base, ins.rina)) {
+					goto error;
+				}
+				VM_LOAD;
+
+				pc = 0;
+				VM_NATIVE;
+				VM_JUMP;
+			} else if (callee->type != FUNC_C) {
+				goto error;
+			}
+		} call_c: {
+			// Also reached by tail calls, C functions always return here
+			int no_ret = AS_FUNC(reg[ins.rout])->c_func(n, ins.rina, &n->stack.items[base + 1 + ins.rout]);
+			if (no_ret < 0) {
+				goto error;
+			}
+
+			// The stack may have been resized and objects moved
+			VM_LOAD;
+
+			for (int i = no_ret;i < ins.rinb;++i) {
+				reg[ins.rout + i] = NIL_VAL;
+			}
+			VM_RESUME;
+		} VM_CASE(TAILCALL): {
+			// As OP_CALL, but the callee takes over this frame and returns
+			// straight to the caller
+			if (!IS_FUNC(reg[ins.rout])) {
+				printf("Attempt to call non-function!\n");
+				print_val(reg[ins.rout]);
+				goto error;
+			}
+
+			switch (AS_FUNC(reg[ins.rout])->type) {
 			case FUNC_NUA:
-				no_ret = nua_call(n, base + 1 + ins.rout, ins.rina, ins.rinb);
-				break;
-			case FUNC_C:	
-				no_ret = reg[ins.rout].func->c_func(ins.rina, &n->stack.items[base + 1 + ins.rout]);				
 				break;
+			case FUNC_C:
+				// Called as normal, followed by the return
+				goto call_c;
 			default:
-				return -1;
+				goto error;
 			}
 
-			val *reg = &n->stack.items[base + 1];	
-									
-			for (int i = no_ret;i < ins.rinb;++i) {
-				reg[ins.rout + i] = (val) { VAL_NIL };
+			for (int i = 0;i <= ins.rina;++i) {
+				n->stack.items[base + i] = reg[ins.rout + i];
 			}
-			break;
-		} case OP_RET: {
+			if (nua_enter(n, base, ins.rina)) {
+				goto error;
+			}
+			VM_LOAD;
+
+			pc = 0;
+			VM_NATIVE;
+			VM_JUMP;
+		} VM_CASE(RET): {
 			// OP is interpreted
 			// .rina = base register
 			// .rout = no values to return
-			for (int i = 0;i < ins.rout;++i) {
+			int no_ret = ins.rout;
+			for (int i = 0;i < no_ret;++i) {
 				n->stack.items[base + i] = reg[ins.rina + i];
 			}
-			
-			return ins.rout;
-		} case OP_ADD:
-			if (reg[ins.rina].type == VAL_NUM
-			&&  reg[ins.rinb].type == VAL_NUM) {
-				reg[ins.rout] = (val) {VAL_NUM, reg[ins.rina].num + reg[ins.rinb].num};
-				break;
+
+			if (n->frames.top == entry) {
+				return no_ret;
 			}
-			break;
-		case OP_SUB:
-			if (reg[ins.rina].type == VAL_NUM
-			&&  reg[ins.rinb].type == VAL_NUM) {
-				reg[ins.rout] = (val) {VAL_NUM, reg[ins.rina].num - reg[ins.rinb].num};
-				break;
+
+			// Continue after the call in the caller
+			frame caller = frame_al_pop(&n->frames);
+			base = caller.base;
+			pc = caller.pc;
+			VM_LOAD;
+
+			ins = f->def->ins.items[pc];
+			for (int i = no_ret;i < ins.rinb;++i) {
+				reg[ins.rout + i] = NIL_VAL;
+			}
+			VM_RESUME;
+		} VM_CASE(ADD):
+			if (IS_INT2(reg[ins.rina], reg[ins.rinb])) {
+				VM_QUICKEN(ADD_II);
+			} else if (IS_NUM(reg[ins.rina]) && IS_NUM(reg[ins.rinb])) {
+				VM_QUICKEN(ADD_NN);
+			}
+			num_add(reg[ins.rina], reg[ins.rinb], &reg[ins.rout]);
+			VM_NEXT;
+		VM_CASE(ADD_II): {
+			if (!IS_INT2(reg[ins.rina], reg[ins.rinb])) {
+				VM_DEOPT(ADD);
+			}
+			int64_t r;
+			if (int_add(AS_INT(reg[ins.rina]), AS_INT(reg[ins.rinb]), &r)) {
+				reg[ins.rout] = INT_VAL(r);
 			} else {
-				print_val(reg[ins.rina]);
-				print_val(reg[ins.rinb]);
-				return -1;
+				num_add(reg[ins.rina], reg[ins.rinb], &reg[ins.rout]);
 			}
-			break;
-		case OP_GT:
-			if (reg[ins.rina].type == VAL_NUM
-			&&  reg[ins.rinb].type == VAL_NUM) {
-				if (reg[ins.rina].num > reg[ins.rinb].num) {
+			VM_NEXT;
+		} VM_CASE(ADD_NN):
+			if (!IS_NUM(reg[ins.rina]) || !IS_NUM(reg[ins.rinb])) {
+				VM_DEOPT(ADD);
+			}
+			reg[ins.rout] = NUM_VAL(AS_NUM(reg[ins.rina]) + AS_NUM(reg[ins.rinb]));
+			VM_NEXT;
+		VM_CASE(SUB):
+			if (IS_INT2(reg[ins.rina], reg[ins.rinb])) {
+				VM_QUICKEN(SUB_II);
+			} else if (IS_NUM(reg[ins.rina]) && IS_NUM(reg[ins.rinb])) {
+				VM_QUICKEN(SUB_NN);
+			}
+			if (num_sub(reg[ins.rina], reg[ins.rinb], &reg[ins.rout])) {
+				VM_NEXT;
+			}
+			print_val(reg[ins.rina]);
+			print_val(reg[ins.rinb]);
+			goto error;
+		VM_CASE(SUB_II): {
+			if (!IS_INT2(reg[ins.rina], reg[ins.rinb])) {
+				VM_DEOPT(SUB);
+			}
+			int64_t r;
+			if (int_sub(AS_INT(reg[ins.rina]), AS_INT(reg[ins.rinb]), &r)) {
+				reg[ins.rout] = INT_VAL(r);
+			} else {
+				num_sub(reg[ins.rina], reg[ins.rinb], &reg[ins.rout]);
+			}
+			VM_NEXT;
+		} VM_CASE(SUB_NN):
+			if (!IS_NUM(reg[ins.rina]) || !IS_NUM(reg[ins.rinb])) {
+				VM_DEOPT(SUB);
+			}
+			reg[ins.rout] = NUM_VAL(AS_NUM(reg[ins.rina]) - AS_NUM(reg[ins.rinb]));
+			VM_NEXT;
+		VM_CASE(GT):
+			if (IS_NUMBER(reg[ins.rina])
+			&&  IS_NUMBER(reg[ins.rinb])) {
+				if (num_lt(reg[ins.rinb], reg[ins.rina])) {
 					reg[ins.rout] = reg[ins.rinb];
 				} else {
-					reg[ins.rout] = (val) {VAL_NIL};
+					reg[ins.rout] = NIL_VAL;
 				}
-				break;
 			}
-			break;
-		case OP_GE:
-			if (reg[ins.rina].type == VAL_NUM
-			&&  reg[ins.rinb].type == VAL_NUM) {
-				if (reg[ins.rina].num >= reg[ins.rinb].num) {
+			VM_NEXT;
+		VM_CASE(GE):
+			if (IS_NUMBER(reg[ins.rina])
+			&&  IS_NUMBER(reg[ins.rinb])) {
+				if (num_le(reg[ins.rinb], reg[ins.rina])) {
 					reg[ins.rout] = reg[ins.rinb];
 				} else {
-					reg[ins.rout] = (val) {VAL_NIL};
+					reg[ins.rout] = NIL_VAL;
 				}
 			}
-			break;
-		case OP_MOV:
+			VM_NEXT;
+		VM_CASE(TGT):
+			// As OP_COVER, with the comparison of OP_GT as the test
+			pc++;
+			if (num_lt(reg[ins.rinb], reg[ins.rina])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		VM_CASE(TGE):
+			pc++;
+			if (num_le(reg[ins.rinb], reg[ins.rina])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		// K forms take a number literal as the second operand
+		VM_CASE(ADDK):
+			if (IS_INT2(reg[ins.rina], lit[ins.rinb])) {
+				VM_QUICKEN(ADDK_II);
+			} else if (IS_NUM(reg[ins.rina]) && IS_NUM(lit[ins.rinb])) {
+				VM_QUICKEN(ADDK_NN);
+			}
+			num_add(reg[ins.rina], lit[ins.rinb], &reg[ins.rout]);
+			VM_NEXT;
+		VM_CASE(ADDK_II): {
+			// The literal never changes, so only the register is checked
+			if (!IS_INT(reg[ins.rina])) {
+				VM_DEOPT(ADDK);
+			}
+			int64_t r;
+			if (int_add(AS_INT(reg[ins.rina]), AS_INT(lit[ins.rinb]), &r)) {
+				reg[ins.rout] = INT_VAL(r);
+			} else {
+				num_add(reg[ins.rina], lit[ins.rinb], &reg[ins.rout]);
+			}
+			VM_NEXT;
+		} VM_CASE(ADDK_NN):
+			if (!IS_NUM(reg[ins.rina])) {
+				VM_DEOPT(ADDK);
+			}
+			reg[ins.rout] = NUM_VAL(AS_NUM(reg[ins.rina]) + AS_NUM(lit[ins.rinb]));
+			VM_NEXT;
+		VM_CASE(SUBK):
+			if (IS_INT2(reg[ins.rina], lit[ins.rinb])) {
+				VM_QUICKEN(SUBK_II);
+			} else if (IS_NUM(reg[ins.rina]) && IS_NUM(lit[ins.rinb])) {
+				VM_QUICKEN(SUBK_NN);
+			}
+			if (num_sub(reg[ins.rina], lit[ins.rinb], &reg[ins.rout])) {
+				VM_NEXT;
+			}
+			print_val(reg[ins.rina]);
+			print_val(lit[ins.rinb]);
+			goto error;
+		VM_CASE(SUBK_II): {
+			if (!IS_INT(reg[ins.rina])) {
+				VM_DEOPT(SUBK);
+			}
+			int64_t r;
+			if (int_sub(AS_INT(reg[ins.rina]), AS_INT(lit[ins.rinb]), &r)) {
+				reg[ins.rout] = INT_VAL(r);
+			} else {
+				num_sub(reg[ins.rina], lit[ins.rinb], &reg[ins.rout]);
+			}
+			VM_NEXT;
+		} VM_CASE(SUBK_NN):
+			if (!IS_NUM(reg[ins.rina])) {
+				VM_DEOPT(SUBK);
+			}
+			reg[ins.rout] = NUM_VAL(AS_NUM(reg[ins.rina]) - AS_NUM(lit[ins.rinb]));
+			VM_NEXT;
+		VM_CASE(GTK):
+			if (IS_NUMBER(reg[ins.rina])) {
+				if (num_lt(lit[ins.rinb], reg[ins.rina])) {
+					reg[ins.rout] = lit[ins.rinb];
+				} else {
+					reg[ins.rout] = NIL_VAL;
+				}
+			}
+			VM_NEXT;
+		VM_CASE(GEK):
+			if (IS_NUMBER(reg[ins.rina])) {
+				if (num_le(lit[ins.rinb], reg[ins.rina])) {
+					reg[ins.rout] = lit[ins.rinb];
+				} else {
+					reg[ins.rout] = NIL_VAL;
+				}
+			}
+			VM_NEXT;
+		VM_CASE(LTK):
+			if (IS_NUMBER(reg[ins.rina])) {
+				if (num_lt(reg[ins.rina], lit[ins.rinb])) {
+					reg[ins.rout] = reg[ins.rina];
+				} else {
+					reg[ins.rout] = NIL_VAL;
+				}
+			}
+			VM_NEXT;
+		VM_CASE(LEK):
+			if (IS_NUMBER(reg[ins.rina])) {
+				if (num_le(reg[ins.rina], lit[ins.rinb])) {
+					reg[ins.rout] = reg[ins.rina];
+				} else {
+					reg[ins.rout] = NIL_VAL;
+				}
+			}
+			VM_NEXT;
+		VM_CASE(TGTK):
+			pc++;
+			if (num_lt(lit[ins.rinb], reg[ins.rina])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		VM_CASE(TGEK):
+			pc++;
+			if (num_le(lit[ins.rinb], reg[ins.rina])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		VM_CASE(TLTK):
+			pc++;
+			if (num_lt(reg[ins.rina], lit[ins.rinb])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		VM_CASE(TLEK):
+			pc++;
+			if (num_le(reg[ins.rina], lit[ins.rinb])) {
+				VM_NEXT;
+			}
+			ins = f->def->ins.items[pc];
+			pc += ins.off;
+			VM_JUMP;
+		VM_CASE(MOV):
 			reg[ins.rout] = reg[ins.rina];
-			break;
-		case OP_TAB:
-			reg[ins.rout] = (val) {VAL_TAB, .tab = gc_alloc(&n->gc_list, sizeof(tab), GC_TAB)};
-			val_ht_resize(&reg[ins.rout].tab->ht, ins.rina);
-			val_al_resize(&reg[ins.rout].tab->al, RH_HASH_SIZE(ins.rinb));
-			break;
-		case OP_PTAB:
-			switch (reg[ins.rout].type) {
+			VM_NEXT;
+		VM_CASE(TAB):
+			reg[ins.rout] = TAB_VAL(gc_alloc_young(&n->gc, sizeof(tab), GC_TAB));
+			// String keys go to slots, so ht is only made when asked for
+			if (ins.rina) {
+				val_ht_resize(&AS_TAB(reg[ins.rout])->ht.rh, ins.rina);
+			}
+			val_al_resize(&AS_TAB(reg[ins.rout])->al, RH_HASH_SIZE(ins.rinb));
+			gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+			VM_NEXT;
+		VM_CASE(PTAB):
+			switch (VAL_TYPE_OF(reg[ins.rout])) {
 			case VAL_TAB:
-				tab_push(reg[ins.rout].tab, reg[ins.rina]);
+				tab_push(AS_TAB(reg[ins.rout]), reg[ins.rina]);
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+				gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
 				break;
 			default:
 				break;
 			}
-			break;
-		case OP_STAB:
-			switch (reg[ins.rout].type) {
+			VM_NEXT;
+		VM_CASE(STAB):
+			switch (VAL_TYPE_OF(reg[ins.rout])) {
 			case VAL_TAB:
-				tab_set(reg[ins.rout].tab, reg[ins.rina], reg[ins.rinb]);
+				if (IS_INT(reg[ins.rina]) && tab_index(reg[ins.rina]) < AS_TAB(reg[ins.rout])->al.top) {
+					VM_QUICKEN(STAB_I);
+				}
+				tab_set(AS_TAB(reg[ins.rout]), reg[ins.rina], reg[ins.rinb]);
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rinb]);
+				gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
 				break;
 			default:
 				print_val(reg[ins.rout]);
 				break;
 			}
-			break;
-		case OP_GTAB:
-			switch (reg[ins.rina].type) {
+			VM_NEXT;
+		VM_CASE(GTAB):
+			switch (VAL_TYPE_OF(reg[ins.rina])) {
 			case VAL_TAB:
-				reg[ins.rout] = tab_get(reg[ins.rina].tab, reg[ins.rinb]);
+				if (IS_INT(reg[ins.rinb]) && tab_index(reg[ins.rinb]) < AS_TAB(reg[ins.rina])->al.top) {
+					VM_QUICKEN(GTAB_I);
+				}
+				reg[ins.rout] = tab_get(AS_TAB(reg[ins.rina]), reg[ins.rinb]);
 				break;
 			default:
 				break;
 			}
-			break;
-		case OP_SENV:
-			tab_set(env, lit[ins.lit], reg[ins.reg]);
-			break;
-		case OP_GENV:
-			reg[ins.reg] = tab_get(env, lit[ins.lit]);
-			break;
+			VM_NEXT;
+		// Keys outside the array part are not misses
+		VM_CASE(STAB_I): {
+			if (!IS_TAB(reg[ins.rout]) || !IS_INT(reg[ins.rina])) {
+				VM_DEOPT(STAB);
+			}
+			tab *t = AS_TAB(reg[ins.rout]);
+			size_t ind = tab_index(reg[ins.rina]);
+			if (ind < t->al.top && !t->proto) {
+				tab_al_set(t, ind, reg[ins.rinb]);
+			} else {
+				tab_set(t, reg[ins.rina], reg[ins.rinb]);
+				gc_tab_storage(&n->gc, t);
+			}
+			gc_barrier(&n->gc, &t->link, reg[ins.rinb]);
+			VM_NEXT;
+		} VM_CASE(GTAB_I): {
+			if (!IS_TAB(reg[ins.rina]) || !IS_INT(reg[ins.rinb])) {
+				VM_DEOPT(GTAB);
+			}
+			tab *t = AS_TAB(reg[ins.rina]);
+			size_t ind = tab_index(reg[ins.rinb]);
+			if (ind < t->al.top) {
+				reg[ins.rout] = tab_al_get(t, ind);
+			} else {
+				reg[ins.rout] = tab_get(t, reg[ins.rinb]);
+			}
+			VM_NEXT;
+		}
+		// Field ops take a string literal as the key
+		VM_CASE(GETF):
+			if (IS_TAB(reg[ins.rina])) {
+				reg[ins.rout] = tab_get_cached(AS_TAB(reg[ins.rina]), lit[ins.rinb], &f->def->cache[pc]);
+			}
+			VM_NEXT;
+		VM_CASE(SETF):
+			if (IS_TAB(reg[ins.rout])) {
+				if (tab_set_cached(AS_TAB(reg[ins.rout]), lit[ins.rinb], reg[ins.rina], &f->def->cache[pc])) {
+					gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+				}
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, lit[ins.rinb]);
+				gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+			} else {
+				print_val(reg[ins.rout]);
+			}
+			VM_NEXT;
+		VM_CASE(SENV):
+			if (tab_set_cached(env, lit[ins.lit], reg[ins.reg], &f->def->cache[pc])) {
+				gc_tab_storage(&n->gc, env);
+			}
+			gc_barrier(&n->gc, &env->link, reg[ins.reg]);
+			VM_NEXT;
+		VM_CASE(GENV):
+			reg[ins.reg] = tab_get_cached(env, lit[ins.lit], &f->def->cache[pc]);
+			VM_NEXT;
+		VM_CASE(FORPREP): {
+			// .reg = counter, followed by the limit, step and variable
+			// .ilit = past the FORLOOP, taken when the loop does not run
+			int run = for_prep(&reg[ins.reg]);
+			if (run > 0) {
+				VM_NEXT;
+			} else if (!run) {
+				pc += ins.ilit;
+				VM_JUMP;
+			}
+			printf("For loop needs numbers, and a step other than 0!\n");
+			print_val(reg[ins.reg]);
+			print_val(reg[ins.reg + 1]);
+			print_val(reg[ins.reg + 2]);
+			goto error;
+		} VM_CASE(FORLOOP):
+			// .ilit = back to the start of the body
+			if (for_loop(&reg[ins.reg])) {
+				pc += ins.ilit;
+				VM_NATIVE;
+				VM_JUMP;
+			}
+			VM_NEXT;
 		default:
 			break;
 		}
-		gc_mark(n, base + f->def->gc_height.items[pc]);
-		gc_sweep(&n->gc_list);
+		if (gc_check(n, base + f->def->gc_height.items[pc])) {
+			f = AS_FUNC(n->stack.items[base]);
+			env = f->env;
+		}
 
 		pc++;
+#ifdef NUA_JIT
+		continue;
+	jit:
+		// Native code may have collected, and leaves off at an instruction
+		// for the interpreter
+		VM_LOAD;
+		pc = jit_run(n, f->def, reg, pc);
+		VM_LOAD;
+		VM_JUMP;
+#endif
 	}
 
-	return 0;
+error:
+	n->frames.top = entry;
+	return -1;
 }
 
 int nua_init() {
@@ -216,25 +853,136 @@ int nua_init() {
 
 nua_state *nua_new_state() {
 	nua_state *n = malloc(sizeof(*n));
-	*n = (nua_state) {.stack = val_al_new(256)};
+	*n = (nua_state) {
+		.stack = val_al_new(256),
+		.frames = frame_al_new(16),
+		.jit_threshold = NUA_JIT_THRESHOLD,
+		.gc = {
+			.threshold = GC_MIN_THRESHOLD,
+			.pause = GC_DEFAULT_PAUSE,
+			.stepmul = GC_DEFAULT_STEPMUL,
+		},
+	};
+	n->gc.young = n->gc.young_top = malloc(GC_NURSERY_SIZE);
+	n->gc.young_end = n->gc.young + GC_NURSERY_SIZE;
+	n->gc.reserve = malloc(GC_RESERVE_SIZE);
 	return n;
 }
 
+// Runs a full cycle, only values on the stack are treated as roots
+int nua_gc_collect(nua_state *n) {
+	gc_full(n, n->stack.top - 1);
+	return 0;
+}
+
+// Pause is the heap growth allowed between cycles as a percentage of the
+// live heap, e.g. 200 waits for the heap to double
+int nua_gc_set_pause(nua_state *n, int pause) {
+	int old = n->gc.pause;
+	n->gc.pause = pause;
+	if (n->gc.state == GC_PAUSE) {
+		gc_set_threshold(&n->gc);
+	}
+	return old;
+}
+
+// Stepmul is the collector's speed relative to allocation as a percentage,
+// larger values give shorter cycles but longer steps
+int nua_gc_set_stepmul(nua_state *n, int stepmul) {
+	int old = n->gc.stepmul;
+	n->gc.stepmul = stepmul;
+	return old;
+}
+
+// Statistics are only recorded without NUA_NO_GC_STATS, otherwise all zero
+gc_stats nua_gc_stats(nua_state *n) {
+	return n->gc.stats;
+}
+
+// Tables must be set through here from C, so the collector sees the store
+int nua_tab_set(nua_state *n, tab *t, val k, val v) {
+	int ret = tab_set(t, k, v);
+	gc_barrier(&n->gc, &t->link, k);
+	gc_barrier(&n->gc, &t->link, v);
+	gc_tab_storage(&n->gc, t);
+	return ret;
+}
+
 tab *nua_new_tab(nua_state *n) {
-	tab *new = gc_alloc(&n->gc_list, sizeof(tab), GC_TAB);
-	*new = (tab) {0};
-	return new;
+	// gc_alloc zeroes the object, so the link must not be overwritten
+	return gc_alloc(&n->gc, sizeof(tab), GC_TAB);
 }
 
 func *nua_new_func(nua_state *n, tab *env) {
-	func *new = gc_alloc(&n->gc_list, sizeof(*new), GC_FUNC);
-	*new = (func) {
-		.type = FUNC_NUA,
-		.def = gc_alloc(&n->gc_list, sizeof(*new->def), GC_FUNCDEF),
-		.env = env,
-	};
+	func *new = gc_alloc(&n->gc, sizeof(*new), GC_FUNC);
+	new->type = FUNC_NUA;
+	new->def = gc_alloc(&n->gc, sizeof(*new->def), GC_FUNCDEF);
+	new->env = env;
+
+	return new;
+}
+
+int nua_set_field(nua_state *n, tab *t, const char *key, val v) {
+	interned_str *k = intern(&n->gc, &n->intern_map, (slice) {
+		.len = strlen(key),
+		.str = (char *)key,
+	});
+	return nua_tab_set(n, t, STR_VAL(k), v);
+}
+
+func *nua_new_c_func(nua_state *n, int (*c_func)(nua_state *n, int no_args, val *stack)) {
+	func *new = gc_alloc(&n->gc, sizeof(*new), GC_FUNC);
+	new->type = FUNC_C;
+	new->c_func = c_func;
 
 	return new;
 }
 
+static tab *nua_gc_type_tab(nua_state *n, size_t *counts) {
+	tab *t = nua_new_tab(n);
+	for (int i = 0;i < GC_MEM_TYPE_NO;++i) {
+		nua_set_field(n, t, gc_mem_type_str[i], NUM_VAL(counts[i]));
+	}
+	return t;
+}
+
+// gc.stats() returns a table of the collector statistics, times are given in
+// microseconds and the freed counts are for the last completed cycle. Only
+// heap is kept under NUA_NO_GC_STATS, where recorded is nil
+int nua_gc_lib_stats(nua_state *n, int no_args, val *stack) {
+	gc_stats s = nua_gc_stats(n);
+	tab *t = nua_new_tab(n);
+
+	GC_STAT(nua_set_field(n, t, "recorded", NUM_VAL(1)));
+	nua_set_field(n, t, "cycles", NUM_VAL(s.cycles));
+	nua_set_field(n, t, "minors", NUM_VAL(s.minors));
+	nua_set_field(n, t, "allocated", NUM_VAL(s.allocated));
+	nua_set_field(n, t, "promoted", NUM_VAL(s.promoted));
+	nua_set_field(n, t, "heap", NUM_VAL(n->gc.allocated));
+	nua_set_field(n, t, "mark", NUM_VAL(s.last.mark_ns / 1000.0));
+	nua_set_field(n, t, "sweep", NUM_VAL(s.last.sweep_ns / 1000.0));
+	nua_set_field(n, t, "minor", NUM_VAL(s.minor_ns / 1000.0));
+	nua_set_field(n, t, "maxpause", NUM_VAL(s.max_pause_ns / 1000.0));
+
+	nua_set_field(n, t, "live", TAB_VAL(nua_gc_type_tab(n, s.live_objects)));
+	nua_set_field(n, t, "freed", TAB_VAL(nua_gc_type_tab(n, s.last.freed_objects)));
+	nua_set_field(n, t, "freedbytes", TAB_VAL(nua_gc_type_tab(n, s.last.freed_bytes)));
+
+	tab *pauses = nua_new_tab(n);
+	for (int i = 0;i < GC_PAUSE_BUCKETS;++i) {
+		tab_push(pauses, NUM_VAL(s.pauses[i]));
+	}
+	gc_tab_storage(&n->gc, pauses);
+	nua_set_field(n, t, "pauses", TAB_VAL(pauses));
+
+	stack[0] = TAB_VAL(t);
+	return 1;
+}
+
+int nua_open_gc(nua_state *n, tab *env) {
+	tab *gc = nua_new_tab(n);
+	nua_set_field(n, gc, "stats", FUNC_VAL(nua_new_c_func(n, &nua_gc_lib_stats)));
+	return nua_set_field(n, env, "gc", TAB_VAL(gc));
+}
+
 #endif
@@ -4,115 +4,456 @@
 #include "val.h"
 #include "gc_types.h"
 
-void gc_sweep(mem_block *p) {
-	if (!p) {
-		return;
+static inline mem_block *val_block(val v) {
+	switch (VAL_TYPE_OF(v)) {
+	case VAL_TAB:
+		return &AS_TAB(v)->link;
+	case VAL_FUNC:
+		return &AS_FUNC(v)->link;
+	case VAL_STR:
+		return &AS_STR(v)->link;
+	default:
+		return NULL;
+	}
+}
+
+// Old objects given a young value are remembered as roots for the next
+// minor collection. Stores into a black object could also hide a white
+// object from the collector, so the object is greyed again to be rescanned.
+// That is left to the atomic step, as a table written to in a loop would
+// otherwise be scanned again by every step
+static inline void gc_barrier(gc_heap *h, mem_block *b, val v) {
+	mem_block *vb = val_block(v);
+	if (vb && gc_is_young(h, vb) && !(b->flags & GC_REMEMBERED) && !gc_is_young(h, b)) {
+		b->flags |= GC_REMEMBERED;
+		gc_grey_list_push(&h->remembered, b);
+	}
+	if (h->state == GC_MARK && b->colour == !h->list.colour) {
+		b->colour = GC_GREY;
+		gc_grey_list_push(&h->grey_again, b);
+	}
+}
+
+// Tables own storage outside of their object, which is counted as it grows
+// so that it paces collection too, and nursery tables towards the next
+// minor collection
+static inline void gc_tab_storage(gc_heap *h, tab *t) {
+	size_t size = tab_storage(t);
+	if (gc_is_young(h, t)) {
+		h->young_storage += size - t->storage;
+	} else {
+		h->allocated += size - t->storage;
+	}
+	t->storage = size;
+}
+
+void gc_set_threshold(gc_heap *h) {
+	size_t threshold = h->allocated / 100 * h->pause;
+	h->threshold = threshold > GC_MIN_THRESHOLD ? threshold : GC_MIN_THRESHOLD;
+}
+
+// Frees the storage owned by an object, but not the object itself
+void gc_finalise(mem_block *b) {
+	switch (b->tag) {
+	case GC_TAB: {
+		tab *t = (tab *)b;
+		if (!t->proto) {
+			val_al_free(&t->al);
+			tab_hash_free(&t->ht);
+			free(t->slots);
+		}
+		break;
+	} case GC_FUNC: {
+		// env will free itself
+		// func_def will free itself
+		break;
+	} case GC_FUNCDEF: {
+		func_def *d = (func_def *)b;
+		inst_list_free(&d->ins);
+		val_al_free(&d->literals);
+		inst_lines_free(&d->lines);
+		inst_lines_free(&d->gc_height);
+		free(d->cache);
+		free(d->misses);
+#ifdef NUA_JIT
+		if (d->jit) {
+			jit_free(d->jit);
+		}
+#endif
+		break;
+	} default:
+		break;
+	}
+}
+
+void gc_free(gc_heap *h, mem_block *b) {
+	gc_finalise(b);
+	h->allocated -= b->size;
+	if (b->tag == GC_TAB) {
+		h->allocated -= ((tab *)b)->storage;
 	}
-	
-	// TODO clear intern table before the gc
-	mem_block **prev = &p->next;
-	mem_block *current = p->next;
-	int white = p->colour;
-
-	while (current) {
-		//puts("Here");
-		if (white ==  current->colour) {
-			mem_block *tofree = current;
-			*prev = current->next;
-			current = *prev;
-			
-			switch (tofree->tag) {
-			case GC_TAB: {
-				//printf("Freeing Table\n");
-				tab *t = (tab *)tofree;
-				val_al_free(&t->al);
-				val_ht_free(&t->ht);
-				break;
-			} case GC_FUNC: {
-				//printf("Freeing Func\n");
-				func *f = (func *)tofree;
-				// env will free itself
-				// func_def will free itself
-				break;
-			} case GC_FUNCDEF: {
-				//printf("Freeing Func def\n");
-				func_def *d = (func_def *)tofree;
-				inst_list_free(&d->ins);
-				val_al_free(&d->literals);
-				inst_lines_free(&d->lines);
-				break;
-			} default:
-				// FIXME we are leaking strings currently
-				break;
+	GC_STAT(
+		h->stats.live_objects[(int)b->tag]--;
+		h->stats.cycle.freed_objects[(int)b->tag]++;
+		h->stats.cycle.freed_bytes[(int)b->tag] += b->size;
+	);
+	if (b->size > GC_POOL_MAX) {
+		free(b);
+	} else {
+		pool_free(&h->pool, b);
+	}
+}
+
+// Walks the live bitmap of the page, returning the work done
+size_t gc_sweep_page(gc_heap *h, pool_page *p) {
+	int white = h->list.colour;
+	char *slots = pool_page_slots(p);
+
+	for (size_t w = 0;w * 64 < p->unused;++w) {
+		uint64_t live = p->live_map[w];
+		while (live) {
+			int bit = __builtin_ctzll(live);
+			live &= live - 1;
+
+			mem_block *b = (mem_block *)(slots + (w * 64 + bit) * p->slot_size);
+			if (b->colour != white) {
+				gc_free(h, b);
 			}
-				
+		}
+	}
 
-			free(tofree);
+	return p->unused * p->slot_size;
+}
+
+void gc_sweep_start(gc_heap *h) {
+	h->sweep_class = 0;
+	h->sweep_page = &h->pool.classes[0].pages;
+	h->sweep = &h->list.next;
+}
+
+// Returns 1 once the whole heap has been swept
+int gc_sweep_step(gc_heap *h, long budget) {
+	int white = h->list.colour;
+
+	while (h->sweep_class < GC_POOL_CLASSES) {
+		pool_page *p = *h->sweep_page;
+		if (!p) {
+			if (++h->sweep_class < GC_POOL_CLASSES) {
+				h->sweep_page = &h->pool.classes[h->sweep_class].pages;
+			}
+			continue;
+		}
+		if (budget <= 0) {
+			return 0;
+		}
+
+		budget -= gc_sweep_page(h, p) / GC_SWEEP_COST;
+		if (p->live) {
+			h->sweep_page = &p->next;
+		} else {
+			*h->sweep_page = p->next;
+			pool_page_release(&h->pool, p);
+		}
+	}
+
+	while (*h->sweep) {
+		if (budget <= 0) {
+			return 0;
+		}
+
+		mem_block *current = *h->sweep;
+		budget -= current->size / GC_SWEEP_COST;
+		if (current->colour == white) {
+			h->sweep = &current->next;
 			continue;
 		}
 
-		prev = &current->next;
-		current = *prev;
+		*h->sweep = current->next;
+		gc_free(h, current);
 	}
+
+	return 1;
 }
 
-void gc_val_mark(val *v, int black);
-void gc_func_def_mark(func_def *d, int black) {
-	if (d->link.colour == black) {
+// Nursery objects are left to be greyed as they are promoted
+void gc_grey(gc_heap *h, mem_block *b) {
+	if (b->colour != h->list.colour || gc_is_young(h, b)) {
 		return;
 	}
-	d->link.colour = black;
-	
-	for (int i = 0;i < d->literals.top;++i) {
-		gc_val_mark(&d->literals.items[i], black);
+
+	switch (b->tag) {
+	case GC_TAB:
+	case GC_FUNC:
+	case GC_FUNCDEF:
+		b->colour = GC_GREY;
+		gc_grey_list_push(&h->grey, b);
+		break;
+	default:
+		// Nothing to scan
+		b->colour = !h->list.colour;
+		break;
 	}
 }
-void gc_tab_mark(tab *t, int black) {
-	if (!t || t->link.colour == black) {
-		return;
+
+void gc_grey_val(gc_heap *h, val *v) {
+	mem_block *b = val_block(*v);
+	if (b) {
+		gc_grey(h, b);
 	}
-	t->link.colour = black;
-	//puts("Marking tab");
-	
-	for (int i = 0;i < t->al.top;++i) {
-		gc_val_mark(&t->al.items[i], black);
-	}
-	if (t->ht.items) {
-		for (int i = 0;i < RH_HASH_SIZE(t->ht.size);++i) {
-			if (t->ht.hash[i]) {
-				gc_val_mark(&t->ht.items[i].key, black);
-				gc_val_mark(&t->ht.items[i].value, black);
+}
+
+// Blackens a grey object, returning the work done
+size_t gc_scan(gc_heap *h, mem_block *b) {
+	b->colour = !h->list.colour;
+
+	switch (b->tag) {
+	case GC_TAB: {
+		tab *t = (tab *)b;
+		// Shared storage is scanned with the literal
+		if (t->proto) {
+			gc_grey(h, &t->proto->link);
+			return sizeof(*t);
+		}
+
+		size_t work = sizeof(*t) + t->al.top * sizeof(val);
+
+		for (int i = 0;t->kind == TAB_VALS && i < t->al.top;++i) {
+			gc_grey_val(h, &t->al.items[i]);
+		}
+		for (size_t i = 0;i < tab_hash_slots(&t->ht);++i) {
+			val_ht_bucket *b = tab_hash_at(&t->ht, i);
+			if (b) {
+				gc_grey_val(h, &b->key);
+				gc_grey_val(h, &b->value);
 			}
 		}
+		work += tab_hash_slots(&t->ht) * sizeof(val_ht_bucket);
+		// Shapes only refer to their keys, so they are kept alive here
+		for (shape *s = t->shape;s;s = s->parent) {
+			gc_grey(h, &s->key->link);
+			gc_grey_val(h, &t->slots[s->no - 1]);
+			work += sizeof(val);
+		}
+		return work;
+	} case GC_FUNC: {
+		func *f = (func *)b;
+		if (f->type == FUNC_NUA) {
+			if (f->env) {
+				gc_grey(h, &f->env->link);
+			}
+			gc_grey(h, &f->def->link);
+		}
+		return sizeof(*f);
+	} case GC_FUNCDEF: {
+		func_def *d = (func_def *)b;
+		for (int i = 0;i < d->literals.top;++i) {
+			gc_grey_val(h, &d->literals.items[i]);
+		}
+		return sizeof(*d) + d->literals.top * sizeof(val);
+	} default:
+		return b->size;
+	}
+}
+
+// Copies a surviving nursery object to the heap list, leaving its new address
+// behind for any other references to it
+mem_block *gc_promote(gc_heap *h, mem_block *b) {
+	if (b->colour == GC_FORWARDED) {
+		return b->next;
 	}
+
+	mem_block *old = gc_alloc_old(h, b->size, b->tag);
+	memcpy(old + 1, b + 1, b->size - sizeof(*b));
+	GC_STAT(h->stats.promoted += b->size);
+	if (b->tag == GC_TAB) {
+		((tab *)old)->storage = 0;
+		gc_tab_storage(h, (tab *)old);
+	}
+	b->colour = GC_FORWARDED;
+	b->next = old;
+
+	gc_grey_list_push(&h->promoted, old);
+	return old;
 }
-void gc_val_mark(val *v, int black) {
-	switch (v->type) {
-	case VAL_TAB: {
-		gc_tab_mark(v->tab, black);
+
+void gc_forward_val(gc_heap *h, val *v) {
+	mem_block *b = val_block(*v);
+	if (!b || !gc_is_young(h, b)) {
+		return;
+	}
+
+	switch (VAL_TYPE_OF(*v)) {
+	case VAL_TAB:
+		*v = TAB_VAL((tab *)gc_promote(h, b));
+		break;
+	case VAL_FUNC:
+		*v = FUNC_VAL((func *)gc_promote(h, b));
 		break;
-	} case VAL_FUNC: {
-		if (v->func->type == FUNC_C) {
-			v->func->link.colour = black;
-			return;
+	case VAL_STR:
+		*v = STR_VAL((interned_str *)gc_promote(h, b));
+		break;
+	default:
+		break;
+	}
+}
+
+// Updates the references held by an old object to anything promoted
+void gc_forward_fields(gc_heap *h, mem_block *b) {
+	switch (b->tag) {
+	case GC_TAB: {
+		tab *t = (tab *)b;
+		if (t->proto) {
+			val proto = TAB_VAL(t->proto);
+			gc_forward_val(h, &proto);
+			t->proto = AS_TAB(proto);
+			break;
+		}
+
+		for (int i = 0;t->kind == TAB_VALS && i < t->al.top;++i) {
+			gc_forward_val(h, &t->al.items[i]);
+		}
+		for (size_t i = 0;t->shape && i < t->shape->no;++i) {
+			gc_forward_val(h, &t->slots[i]);
 		}
-		
-		if (v->func->link.colour == black) {
-			return;
+		int rehash = 0;
+		for (size_t i = 0;i < tab_hash_slots(&t->ht);++i) {
+			val_ht_bucket *b = tab_hash_at(&t->ht, i);
+			if (b) {
+				val key = b->key;
+				gc_forward_val(h, &b->key);
+				gc_forward_val(h, &b->value);
+				rehash |= !val_eq(key, b->key);
+			}
 		}
-		v->func->link.colour = black;
-		//puts("Marking func");
-		gc_tab_mark(v->func->env, black);
-		gc_func_def_mark(v->func->def, black);
 
+		// Objects are hashed by address
+		if (rehash) {
+			tab_hash ht = {0};
+			for (size_t i = 0;i < tab_hash_slots(&t->ht);++i) {
+				val_ht_bucket *b = tab_hash_at(&t->ht, i);
+				if (b) {
+					tab_hash_set(&ht, b->key, b->value);
+				}
+			}
+			tab_hash_free(&t->ht);
+			t->ht = ht;
+			t->layout = 0;
+			gc_tab_storage(h, t);
+		}
 		break;
-	} case VAL_STR: {
-		//puts("Marking str");
-		v->str->link.colour = black;
+	} case GC_FUNC: {
+		func *f = (func *)b;
+		if (f->type == FUNC_NUA) {
+			if (f->env && gc_is_young(h, f->env)) {
+				f->env = (tab *)gc_promote(h, &f->env->link);
+			}
+			if (gc_is_young(h, f->def)) {
+				f->def = (func_def *)gc_promote(h, &f->def->link);
+			}
+		}
+		break;
+	} case GC_FUNCDEF: {
+		func_def *d = (func_def *)b;
+		for (int i = 0;i < d->literals.top;++i) {
+			gc_forward_val(h, &d->literals.items[i]);
+		}
 		break;
 	} default:
 		break;
 	}
 }
 
+// Called once the roots have been forwarded, promotes everything they reach
+// and frees what was left behind in the nursery. Promoted objects are white
+// like any other new object, so black objects that now hold them are
+// rescanned in the atomic step, as marking passed over their young values
+void gc_minor_finish(gc_heap *h) {
+	while (h->remembered.top) {
+		mem_block *b = gc_grey_list_pop(&h->remembered);
+		b->flags &= ~GC_REMEMBERED;
+		gc_forward_fields(h, b);
+		if (h->state == GC_MARK && b->colour == !h->list.colour) {
+			b->colour = GC_GREY;
+			gc_grey_list_push(&h->grey_again, b);
+		}
+	}
+	while (h->promoted.top) {
+		gc_forward_fields(h, gc_grey_list_pop(&h->promoted));
+	}
+
+	for (char *p = h->young;p < h->young_top;) {
+		mem_block *b = (mem_block *)p;
+		p += b->size;
+
+		// Promoted objects took their storage with them
+		if (b->colour != GC_FORWARDED) {
+			gc_finalise(b);
+		}
+	}
+
+	h->young_top = h->young;
+	h->young_storage = 0;
+}
+
+// The intern table does not keep strings alive, so those still white once
+// marking is done are dropped from it and left to be swept
+void gc_clear_interned(gc_heap *h, str_map *m) {
+	if (!m->items) {
+		return;
+	}
+
+	str_map live = {0};
+	for (size_t i = 0;i < RH_HASH_SIZE(m->size);++i) {
+		if (m->hash[i] && m->items[i].value->link.colour != h->list.colour) {
+			str_map_set(&live, m->items[i].key, m->items[i].value);
+		}
+	}
+
+	str_map_free(m);
+	*m = live;
+}
+
+// Calls fn on every object in the heap and nursery, including any which are
+// dead but not yet swept
+void gc_each(gc_heap *h, void (*fn)(mem_block *b, void *data), void *data) {
+	for (int c = 0;c < GC_POOL_CLASSES;++c) {
+		for (pool_page *p = h->pool.classes[c].pages;p;p = p->next) {
+			char *slots = pool_page_slots(p);
+			for (size_t w = 0;w * 64 < p->unused;++w) {
+				uint64_t live = p->live_map[w];
+				while (live) {
+					int bit = __builtin_ctzll(live);
+					live &= live - 1;
+					fn((mem_block *)(slots + (w * 64 + bit) * p->slot_size), data);
+				}
+			}
+		}
+	}
+
+	for (mem_block *b = h->list.next;b;b = b->next) {
+		fn(b, data);
+	}
+
+	for (char *p = h->young;p < h->young_top;) {
+		mem_block *b = (mem_block *)p;
+		p += b->size;
+		if (b->colour != GC_FORWARDED) {
+			fn(b, data);
+		}
+	}
+}
+
+// Returns 1 once there is nothing left to scan
+int gc_propagate(gc_heap *h, long budget) {
+	while (h->grey.top) {
+		if (budget <= 0) {
+			return 0;
+		}
+
+		budget -= gc_scan(h, gc_grey_list_pop(&h->grey));
+	}
+
+	return 1;
+}
+
 #endif
@@ -0,0 +1,201 @@
+#ifndef NUA_GC_POOL_H
+#define NUA_GC_POOL_H
+
+#include <sys/mman.h>
+
+#include "gen/rh_al.h"
+
+// Small objects are allocated from pages holding slots of a single size class.
+// Pages are aligned to their size, so the page of any slot can be found
+// from its address
+#define GC_PAGE_SIZE (64 * 1024)
+#define GC_POOL_MAX 1024
+// Classes are spaced 16 bytes apart up to 256, then 64 bytes apart
+#define GC_POOL_CLASSES (256 / 16 + (GC_POOL_MAX - 256) / 64)
+// Empty pages kept mapped for reuse, beyond this they are unmapped
+#define GC_POOL_EMPTY_MAX 64
+
+typedef struct pool_slot {
+	struct pool_slot *next;
+} pool_slot;
+
+typedef struct pool_page {
+	struct pool_page *next;		// All pages of the class
+	struct pool_page *avail_next;	// Pages of the class with free slots
+	struct pool_page *avail_prev;
+	int avail;
+
+	int cls;
+	uint32_t slot_size, no_slots;
+	uint32_t live;
+	uint32_t unused;		// Slots from here on have never been used
+
+	pool_slot *free;
+	uint64_t live_map[GC_PAGE_SIZE / 16 / 64];
+} pool_page;
+
+#define GC_PAGE_HEADER ((sizeof(pool_page) + 15) & ~(size_t)15)
+
+typedef struct pool_class {
+	pool_page *pages;
+	pool_page *avail;
+} pool_class;
+
+RH_AL_MAKE(pool_page_list, pool_page *)
+
+typedef struct gc_pool {
+	pool_class classes[GC_POOL_CLASSES];
+	pool_page_list empty;
+} gc_pool;
+
+static inline int pool_class_of(size_t size) {
+	if (size <= 256) {
+		return (size + 15) / 16 - 1;
+	}
+	return 256 / 16 + (size - 256 + 63) / 64 - 1;
+}
+
+static inline size_t pool_class_size(int cls) {
+	if (cls < 256 / 16) {
+		return (cls + 1) * 16;
+	}
+	return 256 + (cls - 256 / 16 + 1) * 64;
+}
+
+static inline pool_page *pool_page_of(void *p) {
+	return (pool_page *)((uintptr_t)p & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+}
+
+static inline char *pool_page_slots(pool_page *p) {
+	return (char *)p + GC_PAGE_HEADER;
+}
+
+static inline void pool_avail_push(pool_class *c, pool_page *p) {
+	p->avail = 1;
+	p->avail_prev = NULL;
+	p->avail_next = c->avail;
+	if (c->avail) {
+		c->avail->avail_prev = p;
+	}
+	c->avail = p;
+}
+
+static inline void pool_avail_remove(pool_class *c, pool_page *p) {
+	if (!p->avail) {
+		return;
+	}
+
+	p->avail = 0;
+	if (p->avail_prev) {
+		p->avail_prev->avail_next = p->avail_next;
+	} else {
+		c->avail = p->avail_next;
+	}
+	if (p->avail_next) {
+		p->avail_next->avail_prev = p->avail_prev;
+	}
+}
+
+static pool_page *pool_page_map(void) {
+	// Over allocate to be able to align the page
+	char *m = mmap(NULL, 2 * GC_PAGE_SIZE, PROT_READ | PROT_WRITE
+			, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		return NULL;
+	}
+
+	char *page = (char *)(((uintptr_t)m + GC_PAGE_SIZE - 1) & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+	if (page > m) {
+		munmap(m, page - m);
+	}
+	if (m + GC_PAGE_SIZE > page) {
+		munmap(page + GC_PAGE_SIZE, m + GC_PAGE_SIZE - page);
+	}
+
+	return (pool_page *)page;
+}
+
+pool_page *pool_page_new(gc_pool *pool, int cls) {
+	pool_page *p = pool->empty.top ? pool_page_list_pop(&pool->empty) : pool_page_map();
+	if (!p) {
+		return NULL;
+	}
+
+	memset(p, 0, sizeof(*p));
+	p->cls = cls;
+	p->slot_size = pool_class_size(cls);
+	p->no_slots = (GC_PAGE_SIZE - GC_PAGE_HEADER) / p->slot_size;
+
+	pool_class *c = &pool->classes[cls];
+	p->next = c->pages;
+	c->pages = p;
+	pool_avail_push(c, p);
+
+	return p;
+}
+
+// Returns a zeroed slot of the size class
+void *pool_alloc(gc_pool *pool, int cls) {
+	pool_class *c = &pool->classes[cls];
+	pool_page *p = c->avail;
+	if (!p && !(p = pool_page_new(pool, cls))) {
+		return NULL;
+	}
+
+	pool_slot *s;
+	if (p->free) {
+		s = p->free;
+		p->free = s->next;
+	} else {
+		s = (pool_slot *)(pool_page_slots(p) + p->unused++ * p->slot_size);
+	}
+
+	size_t i = ((char *)s - pool_page_slots(p)) / p->slot_size;
+	p->live_map[i / 64] |= (uint64_t)1 << (i % 64);
+	p->live++;
+
+	if (!p->free && p->unused == p->no_slots) {
+		pool_avail_remove(c, p);
+	}
+
+	memset(s, 0, p->slot_size);
+	return s;
+}
+
+void pool_free(gc_pool *pool, void *slot) {
+	pool_page *p = pool_page_of(slot);
+	size_t i = ((char *)slot - pool_page_slots(p)) / p->slot_size;
+	p->live_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+	p->live--;
+
+	pool_slot *s = slot;
+	s->next = p->free;
+	p->free = s;
+
+	if (!p->avail) {
+		pool_avail_push(&pool->classes[p->cls], p);
+	}
+}
+
+// The page must already be unlinked from its class list, the memory is
+// returned to the OS but stays mapped for reuse by any class
+void pool_page_release(gc_pool *pool, pool_page *p) {
+	pool_avail_remove(&pool->classes[p->cls], p);
+
+	if (pool->empty.top >= GC_POOL_EMPTY_MAX) {
+		munmap(p, GC_PAGE_SIZE);
+		return;
+	}
+
+	madvise(p, GC_PAGE_SIZE, MADV_DONTNEED);
+	pool_page_list_push(&pool->empty, p);
+}
+
+// Unmaps the empty pages kept for reuse
+void pool_trim(gc_pool *pool) {
+	while (pool->empty.top) {
+		munmap(pool_page_list_pop(&pool->empty), GC_PAGE_SIZE);
+	}
+}
+
+#endif
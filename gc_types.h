@@ -1,23 +1,221 @@
 #ifndef NUA_GC_TYPES_H
 #define NUA_GC_TYPES_H
 
+#include <time.h>
+
+#include "gen/rh_al.h"
+
+#include "gc_pool.h"
+
+// Collector statistics can be compiled out with -DNUA_NO_GC_STATS
+#ifndef NUA_NO_GC_STATS
+#define GC_STAT(...) __VA_ARGS__
+#else
+#define GC_STAT(...)
+#endif
+
 typedef struct mem_block {
-	struct mem_block *next;
-	char tag, colour;
+	struct mem_block *next;	// Forwarding address once promoted from the nursery
+	char tag, colour, flags;
+	uint32_t size;
 } mem_block;
 
-enum gc_mem_type { GC_FLAT, GC_TAB, GC_FUNC, GC_FUNCDEF, GC_USERDATA };
+enum gc_mem_type { GC_FLAT, GC_TAB, GC_FUNC, GC_FUNCDEF, GC_USERDATA, GC_MEM_TYPE_NO };
+const char *gc_mem_type_str[GC_MEM_TYPE_NO] = { "flat", "tab", "func", "funcdef", "userdata" };
+
+// White alternates between 0 and 1 each cycle, black is always !white
+#define GC_GREY 2
+// Nursery objects that have been copied out
+#define GC_FORWARDED 3
+
+// Old objects in the remembered set
+#define GC_REMEMBERED 1
+
+enum gc_state { GC_PAUSE, GC_MARK, GC_SWEEP };
+
+// A cycle is started once the heap reaches threshold, which is then reset to
+// pause percent of what survived the cycle
+#define GC_DEFAULT_PAUSE 200
+#define GC_MIN_THRESHOLD (64 * 1024)
+
+// While a cycle is running a step is taken every GC_STEP_SIZE bytes allocated,
+// each doing stepmul percent of that in marking or sweeping work
+#define GC_DEFAULT_STEPMUL 200
+#define GC_STEP_SIZE (16 * 1024)
+// Sweeping only looks at the header of each object, so a byte swept counts
+// for this fraction of a byte marked
+#define GC_SWEEP_COST 4
+
+// Short lived objects are bump allocated in the nursery, and copied to the
+// heap list if they survive a minor collection. A minor collection is taken
+// once less than GC_NURSERY_RESERVE is left, or once nursery tables own more
+// than GC_NURSERY_SIZE bytes of storage
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_NURSERY_RESERVE (4 * 1024)
+
+// Roots are only known at gc_check, so nothing can be collected when an
+// allocation fails. This much is held back from the start and given up
+// instead, to carry on to the next check, which collects in full
+#define GC_RESERVE_SIZE (1024 * 1024)
+
+RH_AL_MAKE(gc_grey_list, mem_block *)
+
+// Bucket i counts pauses of under 2^i microseconds
+#define GC_PAUSE_BUCKETS 20
+
+typedef struct gc_cycle_stats {
+	uint64_t mark_ns, sweep_ns;
+	size_t freed_objects[GC_MEM_TYPE_NO];
+	size_t freed_bytes[GC_MEM_TYPE_NO];
+} gc_cycle_stats;
+
+typedef struct gc_stats {
+	size_t cycles, minors;
+	size_t allocated;	// Bytes ever allocated, including the nursery
+	size_t promoted;	// Bytes copied out of the nursery
+	size_t live_objects[GC_MEM_TYPE_NO];	// Outside of the nursery
+	uint64_t minor_ns;
+	uint64_t max_pause_ns;
+	size_t pauses[GC_PAUSE_BUCKETS];
+	gc_cycle_stats cycle;	// Cycle in progress
+	gc_cycle_stats last;	// Last completed cycle
+} gc_stats;
+
+typedef struct gc_heap {
+	gc_pool pool;		// Objects of up to GC_POOL_MAX bytes
+	mem_block list;		// Larger objects
+	size_t allocated;	// Bytes held by old objects
+	size_t threshold;	// Take a step once allocated reaches this
+	int pause;
+	int stepmul;
+
+	// Incremental state
+	int state;
+	gc_grey_list grey;	// Marked objects still to be scanned
+	gc_grey_list grey_again;	// Black objects written to, rescanned atomically
+	int sweep_class;	// Pages are swept a class at a time
+	pool_page **sweep_page;
+	mem_block **sweep;	// Next link of the large objects to be swept
+
+	// Generational state
+	char *young, *young_top, *young_end;
+	size_t young_storage;	// Bytes owned by nursery tables
+	gc_grey_list remembered;	// Old tables that may hold young objects
+	gc_grey_list promoted;	// Copied out by a minor collection, to be forwarded
+
+	void *reserve;		// See GC_RESERVE_SIZE
+	int emergency;		// The reserve was given up
+
+	gc_stats stats;
+} gc_heap;
+
+static inline uint64_t gc_clock_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline void gc_stat_pause(gc_heap *h, uint64_t ns) {
+	if (ns > h->stats.max_pause_ns) {
+		h->stats.max_pause_ns = ns;
+	}
+
+	int bucket = 0;
+	for (uint64_t us = ns / 1000;us && bucket < GC_PAUSE_BUCKETS - 1;us >>= 1) {
+		++bucket;
+	}
+	h->stats.pauses[bucket]++;
+}
+
+int gc_sweep_step(gc_heap *h, long budget);
+
+// Size must be that of a pool class, or larger than GC_POOL_MAX
+static mem_block *gc_alloc_block(gc_heap *h, size_t size) {
+	if (size <= GC_POOL_MAX) {
+		return pool_alloc(&h->pool, pool_class_of(size));
+	}
 
-void *gc_alloc(mem_block *p, size_t size, int type) {
 	mem_block *mem = calloc(size, 1);
-	mem->next = p->next;
+	if (mem) {
+		mem->next = h->list.next;
+		h->list.next = mem;
+	}
+	return mem;
+}
+
+// Gives up the reserve, then frees whatever the sweep in progress would,
+// which is known to be dead without the roots, and empty pages
+static mem_block *gc_alloc_retry(gc_heap *h, size_t size) {
+	mem_block *mem = NULL;
+	if (h->reserve) {
+		free(h->reserve);
+		h->reserve = NULL;
+		h->emergency = 1;
+		h->threshold = 0;
+		mem = gc_alloc_block(h, size);
+	}
+	if (!mem && h->state == GC_SWEEP) {
+		gc_sweep_step(h, LONG_MAX);
+		mem = gc_alloc_block(h, size);
+	}
+	if (!mem) {
+		pool_trim(&h->pool);
+		mem = gc_alloc_block(h, size);
+	}
+	if (!mem) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	return mem;
+}
+
+void *gc_alloc_old(gc_heap *h, size_t size, int type) {
+	if (size <= GC_POOL_MAX) {
+		size = pool_class_size(pool_class_of(size));
+	}
+	mem_block *mem = gc_alloc_block(h, size);
+	if (!mem) {
+		mem = gc_alloc_retry(h, size);
+	}
+
 	mem->tag = type;
-	// FIXME use real white
-	mem->colour = p->colour;
+	mem->size = size;
+	mem->colour = h->list.colour;
 	
-	p->next = mem;
+	h->allocated += size;
+	GC_STAT(h->stats.live_objects[type]++);
+
+	return (void *) mem;
+}
+
+void *gc_alloc(gc_heap *h, size_t size, int type) {
+	GC_STAT(h->stats.allocated += size);
+	return gc_alloc_old(h, size, type);
+}
+
+static inline int gc_is_young(gc_heap *h, void *p) {
+	return (char *)p >= h->young && (char *)p < h->young_end;
+}
+
+// For objects likely to die young, which are only referenced from the stack
+// and other objects. They may be moved by any collection, so C code must not
+// hold onto them
+void *gc_alloc_young(gc_heap *h, size_t size, int type) {
+	size = (size + 7) & ~(size_t)7;
+	if (h->young_end - h->young_top < size) {
+		return gc_alloc(h, size, type);
+	}
+
+	mem_block *mem = (mem_block *)h->young_top;
+	h->young_top += size;
+	GC_STAT(h->stats.allocated += size);
+
+	memset(mem, 0, size);
+	mem->tag = type;
+	mem->size = size;
+	mem->colour = h->list.colour;
 
 	return (void *) mem;
 }
 
-#endif
\ No newline at end of file
+#endif
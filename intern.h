@@ -53,17 +53,16 @@ slice slice_from_intern(interned_str *i) {
 	};
 }
 
-interned_str *intern_from_slice(mem_block *gc, slice c) {
+interned_str *intern_from_slice(gc_heap *gc, slice c) {
 	interned_str *s = gc_alloc(gc, sizeof(interned_str) + c.len + 1, GC_FLAT);
 	s->len = c.len;
-	s->link.next = NULL;
 	memcpy(s->str, c.str, c.len);
 	s->str[c.len] = '\0';
 	
 	return s;
 }
 
-interned_str *intern(mem_block *gc, str_map *m, slice s) {
+interned_str *intern(gc_heap *gc, str_map *m, slice s) {
 	str_map_bucket *b = str_map_find(m, s);
 	if (!b) {
 		interned_str *i = intern_from_slice(gc, s);
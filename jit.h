@@ -0,0 +1,616 @@
+#ifndef NUA_JIT_H
+#define NUA_JIT_H
+
+#ifdef NUA_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+// A baseline compiler from the instructions of a function to x86-64, with
+// one template per opcode. Registers stay in the stack window, which rbx
+// points at for the whole run, so any instruction can hand over to the
+// interpreter by returning its pc. Calls and returns always do, the rest
+// is either done inline or through jit_slow
+
+typedef struct jit_code {
+	uint8_t *mem;
+	size_t size;
+	uint8_t **entry;	// Native code of each instruction
+} jit_code;
+
+typedef int (*jit_fn)(val *reg, nua_state *n, uint8_t *at);
+
+// Room for the longest template
+#define JIT_INS_MAX 192
+
+typedef struct jit_fixup {
+	size_t at;		// Of the rel32 to patch
+	int pc;			// Instruction jumped to
+} jit_fixup;
+
+RH_AL_MAKE(jit_fixups, jit_fixup)
+
+typedef struct jit_buf {
+	uint8_t *code;
+	size_t top, size;
+	size_t exit;		// Returns the pc in eax
+	jit_fixups fixups;
+} jit_buf;
+
+// Registers and their parts as offsets from rbx
+#define JIT_REG(R) ((int32_t)((R) * sizeof(val)))
+#ifndef NUA_NAN_BOXING
+#define JIT_TYPE(R) (JIT_REG(R) + (int32_t)offsetof(val, type))
+#define JIT_DATA(R) (JIT_REG(R) + (int32_t)offsetof(val, i))
+#endif
+
+// Condition codes of jcc
+#define JIT_JMP 0
+#define JIT_JO 0x80
+#define JIT_JS 0x88
+#define JIT_JNE 0x85
+#define JIT_JL 0x8c
+#define JIT_JGE 0x8d
+#define JIT_JLE 0x8e
+#define JIT_JG 0x8f
+
+// Writes past the end are only counted, and fail the compile
+static void jit_u8(jit_buf *b, uint8_t x) {
+	if (b->top < b->size) {
+		b->code[b->top] = x;
+	}
+	b->top++;
+}
+
+static void jit_u32(jit_buf *b, uint32_t x) {
+	for (int i = 0;i < 4;++i) {
+		jit_u8(b, x >> (8 * i));
+	}
+}
+
+static void jit_u64(jit_buf *b, uint64_t x) {
+	for (int i = 0;i < 8;++i) {
+		jit_u8(b, x >> (8 * i));
+	}
+}
+
+static void jit_bytes(jit_buf *b, const char *bytes, size_t no) {
+	for (size_t i = 0;i < no;++i) {
+		jit_u8(b, bytes[i]);
+	}
+}
+
+// Opcode bytes followed by a [rbx+disp32] operand
+static void jit_rbx(jit_buf *b, const char *op, size_t no, int reg, int32_t disp) {
+	jit_bytes(b, op, no);
+	jit_u8(b, 0x80 | reg << 3 | 3);
+	jit_u32(b, disp);
+}
+
+static void jit_patch(jit_buf *b, size_t at, size_t to) {
+	int32_t rel = to - (at + 4);
+	if (at + 4 <= b->size) {
+		memcpy(&b->code[at], &rel, sizeof(rel));
+	}
+}
+
+// Jumps to the code of an instruction, patched once all are placed
+static void jit_jump(jit_buf *b, uint8_t cc, int pc) {
+	if (cc == JIT_JMP) {
+		jit_u8(b, 0xe9);
+	} else {
+		jit_u8(b, 0x0f);
+		jit_u8(b, cc);
+	}
+	jit_fixups_push(&b->fixups, (jit_fixup) {b->top, pc});
+	jit_u32(b, 0);
+}
+
+// Jumps forward within a template, gives where to patch with jit_land
+static size_t jit_skip(jit_buf *b, uint8_t cc) {
+	jit_u8(b, 0x0f);
+	jit_u8(b, cc);
+	jit_u32(b, 0);
+	return b->top - 4;
+}
+
+static void jit_land(jit_buf *b, size_t at) {
+	jit_patch(b, at, b->top);
+}
+
+static void jit_exit(jit_buf *b, int pc) {
+	jit_u8(b, 0xb8);		// mov eax, pc
+	jit_u32(b, pc);
+	jit_u8(b, 0xe9);		// jmp exit
+	jit_u32(b, b->exit - (b->top + 4));
+}
+
+// Value of a register, or of the value pointed to by rax, into xmm0 or rax
+static void jit_load(jit_buf *b, int r) {
+#ifdef NUA_NAN_BOXING
+	jit_rbx(b, "\x48\x8b", 2, 0, JIT_REG(r));		// mov rax, [rbx+r]
+#else
+	jit_rbx(b, "\xf3\x0f\x6f", 3, 0, JIT_REG(r));		// movdqu xmm0, [rbx+r]
+#endif
+}
+
+static void jit_load_rax(jit_buf *b) {
+#ifdef NUA_NAN_BOXING
+	jit_bytes(b, "\x48\x8b\x00", 3);			// mov rax, [rax]
+#else
+	jit_bytes(b, "\xf3\x0f\x6f\x00", 4);			// movdqu xmm0, [rax]
+#endif
+}
+
+static void jit_store(jit_buf *b, int r) {
+#ifdef NUA_NAN_BOXING
+	jit_rbx(b, "\x48\x89", 2, 0, JIT_REG(r));		// mov [rbx+r], rax
+#else
+	jit_rbx(b, "\xf3\x0f\x7f", 3, 0, JIT_REG(r));		// movdqu [rbx+r], xmm0
+#endif
+}
+
+static void jit_nil(jit_buf *b, int r) {
+#ifdef NUA_NAN_BOXING
+	jit_bytes(b, "\x31\xc0", 2);				// xor eax, eax
+#else
+	jit_bytes(b, "\x66\x0f\xef\xc0", 4);			// pxor xmm0, xmm0
+#endif
+	jit_store(b, r);
+}
+
+// Does an instruction for native code as the interpreter would. Tests give
+// whether they hold, for loops whether they jump, everything else 0, or -1
+// to leave the instruction to the interpreter
+static int jit_slow(nua_state *n, val *reg, int pc) {
+	func *f = AS_FUNC(reg[-1]);
+	val *lit = f->def->literals.items;
+	inst ins = f->def->ins.items[pc];
+	ins.op = op_base(ins.op);
+
+	switch (ins.op) {
+	case OP_SETL:
+		// Only tables and functions, other literals are copied inline
+		if (IS_TAB(lit[ins.lit])) {
+			reg[ins.reg] = TAB_VAL(gc_alloc_young(&n->gc, sizeof(tab), GC_TAB));
+			tab_share(AS_TAB(reg[ins.reg]), AS_TAB(lit[ins.lit]));
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.reg])->link, lit[ins.lit]);
+		} else {
+			reg[ins.reg] = FUNC_VAL(gc_alloc_young(&n->gc, sizeof(func), GC_FUNC));
+			AS_FUNC(reg[ins.reg])->type = FUNC_NUA;
+			AS_FUNC(reg[ins.reg])->def = AS_FUNC(lit[ins.lit])->def;
+			AS_FUNC(reg[ins.reg])->env = f->env;
+		}
+		gc_check(n, (reg - n->stack.items) - 1 + f->def->gc_height.items[pc]);
+		return 0;
+	case OP_TAB:
+		reg[ins.rout] = TAB_VAL(gc_alloc_young(&n->gc, sizeof(tab), GC_TAB));
+		// String keys go to slots, so ht is only made when asked for
+		if (ins.rina) {
+			val_ht_resize(&AS_TAB(reg[ins.rout])->ht.rh, ins.rina);
+		}
+		val_al_resize(&AS_TAB(reg[ins.rout])->al, RH_HASH_SIZE(ins.rinb));
+		gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+		gc_check(n, (reg - n->stack.items) - 1 + f->def->gc_height.items[pc]);
+		return 0;
+	case OP_ADD:
+		num_add(reg[ins.rina], reg[ins.rinb], &reg[ins.rout]);
+		return 0;
+	case OP_SUB:
+		return num_sub(reg[ins.rina], reg[ins.rinb], &reg[ins.rout]) ? 0 : -1;
+	case OP_ADDK:
+		num_add(reg[ins.rina], lit[ins.rinb], &reg[ins.rout]);
+		return 0;
+	case OP_SUBK:
+		return num_sub(reg[ins.rina], lit[ins.rinb], &reg[ins.rout]) ? 0 : -1;
+	case OP_GT:
+	case OP_GE:
+		if (IS_NUMBER(reg[ins.rina]) && IS_NUMBER(reg[ins.rinb])) {
+			int holds = ins.op == OP_GT ? num_lt(reg[ins.rinb], reg[ins.rina])
+				: num_le(reg[ins.rinb], reg[ins.rina]);
+			reg[ins.rout] = holds ? reg[ins.rinb] : NIL_VAL;
+		}
+		return 0;
+	case OP_GTK:
+	case OP_GEK:
+		if (IS_NUMBER(reg[ins.rina])) {
+			int holds = ins.op == OP_GTK ? num_lt(lit[ins.rinb], reg[ins.rina])
+				: num_le(lit[ins.rinb], reg[ins.rina]);
+			reg[ins.rout] = holds ? lit[ins.rinb] : NIL_VAL;
+		}
+		return 0;
+	case OP_LTK:
+	case OP_LEK:
+		if (IS_NUMBER(reg[ins.rina])) {
+			int holds = ins.op == OP_LTK ? num_lt(reg[ins.rina], lit[ins.rinb])
+				: num_le(reg[ins.rina], lit[ins.rinb]);
+			reg[ins.rout] = holds ? reg[ins.rina] : NIL_VAL;
+		}
+		return 0;
+	case OP_TGT:
+		return num_lt(reg[ins.rinb], reg[ins.rina]);
+	case OP_TGE:
+		return num_le(reg[ins.rinb], reg[ins.rina]);
+	case OP_TGTK:
+		return num_lt(lit[ins.rinb], reg[ins.rina]);
+	case OP_TGEK:
+		return num_le(lit[ins.rinb], reg[ins.rina]);
+	case OP_TLTK:
+		return num_lt(reg[ins.rina], lit[ins.rinb]);
+	case OP_TLEK:
+		return num_le(reg[ins.rina], lit[ins.rinb]);
+	case OP_PTAB:
+		if (IS_TAB(reg[ins.rout])) {
+			tab_push(AS_TAB(reg[ins.rout]), reg[ins.rina]);
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+			gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+		}
+		return 0;
+	case OP_STAB:
+		if (IS_TAB(reg[ins.rout])) {
+			tab_set(AS_TAB(reg[ins.rout]), reg[ins.rina], reg[ins.rinb]);
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rinb]);
+			gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+		} else {
+			print_val(reg[ins.rout]);
+		}
+		return 0;
+	case OP_GTAB:
+		if (IS_TAB(reg[ins.rina])) {
+			reg[ins.rout] = tab_get(AS_TAB(reg[ins.rina]), reg[ins.rinb]);
+		}
+		return 0;
+	case OP_GETF:
+		if (IS_TAB(reg[ins.rina])) {
+			reg[ins.rout] = tab_get_cached(AS_TAB(reg[ins.rina]), lit[ins.rinb], &f->def->cache[pc]);
+		}
+		return 0;
+	case OP_SETF:
+		if (IS_TAB(reg[ins.rout])) {
+			if (tab_set_cached(AS_TAB(reg[ins.rout]), lit[ins.rinb], reg[ins.rina], &f->def->cache[pc])) {
+				gc_tab_storage(&n->gc, AS_TAB(reg[ins.rout]));
+			}
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, lit[ins.rinb]);
+			gc_barrier(&n->gc, &AS_TAB(reg[ins.rout])->link, reg[ins.rina]);
+		} else {
+			print_val(reg[ins.rout]);
+		}
+		return 0;
+	case OP_SENV:
+		if (tab_set_cached(f->env, lit[ins.lit], reg[ins.reg], &f->def->cache[pc])) {
+			gc_tab_storage(&n->gc, f->env);
+		}
+		gc_barrier(&n->gc, &f->env->link, reg[ins.reg]);
+		return 0;
+	case OP_GENV:
+		reg[ins.reg] = tab_get_cached(f->env, lit[ins.lit], &f->def->cache[pc]);
+		return 0;
+	case OP_FORPREP: {
+		// Errors are raised by the interpreter
+		int run = for_prep(&reg[ins.reg]);
+		return run < 0 ? -1 : !run;
+	} case OP_FORLOOP:
+		return for_loop(&reg[ins.reg]);
+	default:
+		return -1;
+	}
+}
+
+static void jit_call_slow(jit_buf *b, int pc) {
+	jit_bytes(b, "\x4c\x89\xe7", 3);		// mov rdi, r12
+	jit_bytes(b, "\x48\x89\xde", 3);		// mov rsi, rbx
+	jit_u8(b, 0xba);				// mov edx, pc
+	jit_u32(b, pc);
+	jit_bytes(b, "\x48\xb8", 2);			// mov rax, jit_slow
+	jit_u64(b, (uintptr_t)&jit_slow);
+	jit_bytes(b, "\xff\xd0", 2);			// call rax
+}
+
+static void jit_slow_op(jit_buf *b, int pc) {
+	jit_call_slow(b, pc);
+	jit_bytes(b, "\x85\xc0", 2);			// test eax, eax
+	jit_bytes(b, "\x79\x0a", 2);			// jns over the exit
+	jit_exit(b, pc);
+}
+
+// Tests continue after the jump that follows them when they hold
+static void jit_slow_test(jit_buf *b, int pc) {
+	jit_call_slow(b, pc);
+	jit_bytes(b, "\x85\xc0", 2);			// test eax, eax
+	jit_jump(b, JIT_JNE, pc + 2);
+}
+
+static void jit_slow_jump(jit_buf *b, int pc, int to) {
+	jit_slow_op(b, pc);
+	jit_jump(b, JIT_JNE, to);
+}
+
+#ifndef NUA_NAN_BOXING
+// Loads the integer of register a into rax, and of b or the literal into
+// rcx, going to the slow path unless both are integers. Gives where to patch
+// the jump to the slow path
+static size_t jit_ints(jit_buf *b, int a, int r, val *k) {
+	if (k) {
+		jit_rbx(b, "\x83", 1, 7, JIT_TYPE(a));		// cmp dword [rbx+a], VAL_INT
+		jit_u8(b, VAL_INT);
+	} else {
+		jit_rbx(b, "\x8b", 1, 0, JIT_TYPE(a));		// mov eax, [rbx+a]
+		jit_rbx(b, "\x23", 1, 0, JIT_TYPE(r));		// and eax, [rbx+r]
+		jit_bytes(b, "\x83\xf8", 2);			// cmp eax, VAL_INT
+		jit_u8(b, VAL_INT);
+	}
+	size_t slow = jit_skip(b, JIT_JNE);
+
+	jit_rbx(b, "\x48\x8b", 2, 0, JIT_DATA(a));		// mov rax, [rbx+a]
+	if (k) {
+		jit_bytes(b, "\x48\xb9", 2);			// mov rcx, k
+		jit_u64(b, AS_INT(*k));
+	} else {
+		jit_rbx(b, "\x48\x8b", 2, 1, JIT_DATA(r));	// mov rcx, [rbx+r]
+	}
+	return slow;
+}
+
+static void jit_arith(jit_buf *b, int pc, inst ins, val *k, int sub) {
+	size_t slow = jit_ints(b, ins.rina, ins.rinb, k);
+	jit_bytes(b, sub ? "\x48\x29\xc8" : "\x48\x01\xc8", 3);	// sub/add rax, rcx
+	size_t over = jit_skip(b, JIT_JO);
+	jit_rbx(b, "\xc7", 1, 0, JIT_TYPE(ins.rout));		// mov dword [rbx+out], VAL_INT
+	jit_u32(b, VAL_INT);
+	jit_rbx(b, "\x48\x89", 2, 0, JIT_DATA(ins.rout));	// mov [rbx+out], rax
+	jit_jump(b, JIT_JMP, pc + 1);
+
+	jit_land(b, slow);
+	jit_land(b, over);
+	jit_slow_op(b, pc);
+}
+
+// Compares a with b or the literal, both orders of the comparison
+static void jit_test(jit_buf *b, int pc, inst ins, val *k, uint8_t cc) {
+	size_t slow = jit_ints(b, ins.rina, ins.rinb, k);
+	jit_bytes(b, "\x48\x39\xc8", 3);			// cmp rax, rcx
+	jit_jump(b, cc, pc + 2);
+	jit_jump(b, JIT_JMP, pc + 1);
+
+	jit_land(b, slow);
+	jit_slow_test(b, pc);
+}
+
+// Steps an integer counter inline, as for_loop
+static void jit_for_loop(jit_buf *b, int pc, inst ins) {
+	int r = ins.reg;
+	jit_rbx(b, "\x83", 1, 7, JIT_TYPE(r));			// cmp dword [rbx+r], VAL_INT
+	jit_u8(b, VAL_INT);
+	size_t slow = jit_skip(b, JIT_JNE);
+
+	jit_rbx(b, "\x48\x8b", 2, 0, JIT_DATA(r));		// mov rax, [rbx+r]
+	jit_rbx(b, "\x48\x8b", 2, 1, JIT_DATA(r + 2));		// mov rcx, [rbx+step]
+	jit_bytes(b, "\x48\x01\xc8", 3);			// add rax, rcx
+	jit_jump(b, JIT_JO, pc + 1);
+	jit_bytes(b, "\x48\x85\xc9", 3);			// test rcx, rcx
+	size_t down = jit_skip(b, JIT_JS);
+	jit_rbx(b, "\x48\x3b", 2, 0, JIT_DATA(r + 1));		// cmp rax, [rbx+limit]
+	jit_jump(b, JIT_JG, pc + 1);
+	jit_u8(b, 0xe9);					// jmp over
+	jit_u32(b, 0);
+	size_t next = b->top - 4;
+	jit_land(b, down);
+	jit_rbx(b, "\x48\x3b", 2, 0, JIT_DATA(r + 1));		// cmp rax, [rbx+limit]
+	jit_jump(b, JIT_JL, pc + 1);
+	jit_land(b, next);
+
+	jit_rbx(b, "\x48\x89", 2, 0, JIT_DATA(r));		// mov [rbx+r], rax
+	jit_rbx(b, "\xc7", 1, 0, JIT_TYPE(r + 3));		// mov dword [rbx+var], VAL_INT
+	jit_u32(b, VAL_INT);
+	jit_rbx(b, "\x48\x89", 2, 0, JIT_DATA(r + 3));		// mov [rbx+var], rax
+	jit_jump(b, JIT_JMP, pc + ins.ilit);
+
+	jit_land(b, slow);
+	jit_slow_jump(b, pc, pc + ins.ilit);
+}
+#endif
+
+static void jit_ins(jit_buf *b, func_def *d, int pc) {
+	// Quickened ops were only for the interpreter
+	inst ins = d->ins.items[pc];
+	ins.op = op_base(ins.op);
+	val *lit = d->literals.items;
+#ifndef NUA_NAN_BOXING
+	// Integer literals of K ops are built into the code
+	val *k = opcode_type[ins.op] == OPT_RRK && IS_INT(lit[ins.rinb]) ? &lit[ins.rinb] : NULL;
+#endif
+
+	switch (ins.op) {
+	case OP_NOP:
+		break;
+	case OP_JMP:
+		jit_jump(b, JIT_JMP, pc + ins.off);
+		break;
+	case OP_COVER:
+#ifdef NUA_NAN_BOXING
+		jit_rbx(b, "\x48\x83", 2, 7, JIT_REG(ins.reg));	// cmp qword [rbx+r], 0
+#else
+		jit_rbx(b, "\x83", 1, 7, JIT_TYPE(ins.reg));	// cmp dword [rbx+r], VAL_NIL
+#endif
+		jit_u8(b, 0);
+		jit_jump(b, JIT_JNE, pc + 2);
+		break;
+	case OP_MOV:
+		jit_load(b, ins.rina);
+		jit_store(b, ins.rout);
+		break;
+	case OP_NIL:
+		jit_nil(b, ins.reg);
+		break;
+	case OP_SETL:
+		if (IS_TAB(lit[ins.lit]) || IS_FUNC(lit[ins.lit])) {
+			jit_slow_op(b, pc);
+			break;
+		}
+		// Literals may be moved by the collector, but the array never is
+		jit_bytes(b, "\x48\xb8", 2);			// mov rax, &lit
+		jit_u64(b, (uintptr_t)&lit[ins.lit]);
+		jit_load_rax(b);
+		jit_store(b, ins.reg);
+		break;
+#ifndef NUA_NAN_BOXING
+	case OP_ADD:
+		jit_arith(b, pc, ins, NULL, 0);
+		break;
+	case OP_SUB:
+		jit_arith(b, pc, ins, NULL, 1);
+		break;
+	case OP_ADDK:
+	case OP_SUBK:
+		if (!k) {
+			jit_slow_op(b, pc);
+			break;
+		}
+		jit_arith(b, pc, ins, k, ins.op == OP_SUBK);
+		break;
+	case OP_TGT:
+		jit_test(b, pc, ins, NULL, JIT_JG);
+		break;
+	case OP_TGE:
+		jit_test(b, pc, ins, NULL, JIT_JGE);
+		break;
+	case OP_TGTK:
+	case OP_TGEK:
+	case OP_TLTK:
+	case OP_TLEK:
+		if (!k) {
+			jit_slow_test(b, pc);
+			break;
+		}
+		jit_test(b, pc, ins, k, ins.op == OP_TGTK ? JIT_JG : ins.op == OP_TGEK ? JIT_JGE
+				: ins.op == OP_TLTK ? JIT_JL : JIT_JLE);
+		break;
+	case OP_FORLOOP:
+		jit_for_loop(b, pc, ins);
+		break;
+#else
+	case OP_ADD:
+	case OP_SUB:
+	case OP_ADDK:
+	case OP_SUBK:
+		jit_slow_op(b, pc);
+		break;
+	case OP_TGT:
+	case OP_TGE:
+	case OP_TGTK:
+	case OP_TGEK:
+	case OP_TLTK:
+	case OP_TLEK:
+		jit_slow_test(b, pc);
+		break;
+	case OP_FORLOOP:
+		jit_slow_jump(b, pc, pc + ins.ilit);
+		break;
+#endif
+	case OP_FORPREP:
+		jit_slow_jump(b, pc, pc + ins.ilit);
+		break;
+	case OP_GT:
+	case OP_GE:
+	case OP_GTK:
+	case OP_GEK:
+	case OP_LTK:
+	case OP_LEK:
+	case OP_TAB:
+	case OP_PTAB:
+	case OP_STAB:
+	case OP_GTAB:
+	case OP_GETF:
+	case OP_SETF:
+	case OP_SENV:
+	case OP_GENV:
+		jit_slow_op(b, pc);
+		break;
+	default:
+		// Calls and returns are left to the interpreter
+		jit_exit(b, pc);
+		break;
+	}
+}
+
+void jit_free(jit_code *j) {
+	munmap(j->mem, j->size);
+	free(j->entry);
+	free(j);
+}
+
+jit_code *jit_compile(func_def *d) {
+	size_t size = (d->ins.top * JIT_INS_MAX + 64 + 4095) & ~(size_t)4095;
+	uint8_t *mem = mmap(NULL, size, PROT_READ | PROT_WRITE
+			, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	jit_buf b = {mem, 0, size, .fixups = jit_fixups_new(16)};
+	size_t *at = malloc(d->ins.top * sizeof(*at));
+
+	// Entered as jit_fn, keeping rsp aligned for calls
+	jit_bytes(&b, "\x53\x41\x54\x41\x55", 5);		// push rbx; push r12; push r13
+	jit_bytes(&b, "\x48\x89\xfb", 3);			// mov rbx, rdi
+	jit_bytes(&b, "\x49\x89\xf4", 3);			// mov r12, rsi
+	jit_bytes(&b, "\xff\xe2", 2);				// jmp rdx
+	b.exit = b.top;
+	jit_bytes(&b, "\x41\x5d\x41\x5c\x5b\xc3", 6);		// pop r13; pop r12; pop rbx; ret
+
+	for (size_t pc = 0;pc < d->ins.top;++pc) {
+		at[pc] = b.top;
+		jit_ins(&b, d, pc);
+	}
+
+	int fail = b.top > b.size;
+	for (size_t i = 0;i < b.fixups.top;++i) {
+		jit_fixup x = b.fixups.items[i];
+		if (x.pc < 0 || (size_t)x.pc >= d->ins.top) {
+			fail = 1;
+			break;
+		}
+		jit_patch(&b, x.at, at[x.pc]);
+	}
+	jit_fixups_free(&b.fixups);
+
+	jit_code *j = NULL;
+	if (!fail && !mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+		j = malloc(sizeof(*j));
+		*j = (jit_code) {mem, size, malloc(d->ins.top * sizeof(*j->entry))};
+		for (size_t pc = 0;pc < d->ins.top;++pc) {
+			j->entry[pc] = mem + at[pc];
+		}
+	} else {
+		munmap(mem, size);
+	}
+
+	free(at);
+	return j;
+}
+
+// Counts towards compiling the function, gives whether it has native code
+static inline int jit_hot(nua_state *n, func_def *d) {
+	if (d->jit) {
+		return 1;
+	}
+	if (d->hot < 0 || !n->jit_threshold || ++d->hot < n->jit_threshold) {
+		return 0;
+	}
+
+	// Only ever tried once
+	d->hot = -1;
+	d->jit = jit_compile(d);
+	return d->jit != NULL;
+}
+
+// Runs native code from pc, until an instruction left to the interpreter,
+// whose pc is returned
+static inline int jit_run(nua_state *n, func_def *d, val *reg, int pc) {
+	return ((jit_fn)d->jit->mem)(reg, n, d->jit->entry[pc]);
+}
+
+#endif
+
+#endif
@@ -1,7 +1,11 @@
+// Needed for mmap and madvise under -std=c11
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include <limits.h>
 
 #include "gen/rh_al.h"
 
@@ -10,8 +14,10 @@
 #include "parse.h"
 
 #include "core_api.h"
+#include "snapshot.h"
+#include "array.h"
 
-int nua_print_val(int no_args, val *stack) {
+int nua_print_val(nua_state *n, int no_args, val *stack) {
 	if (!no_args) {
 		return 0;
 	}
@@ -34,7 +40,7 @@ func *nua_load_file(nua_state *n, tab *env, char *file_name) {
 	parser p = {
 		file_name, file,
 		.lstart = file,
-		.gc_heap = &n->gc_list,
+		.gc_heap = &n->gc,
 		.intern_map = &n->intern_map
 	};
 
@@ -57,6 +63,12 @@ int main(int argn, char **args) {
 	nua_init();
 	
 	nua_state *n = nua_new_state();
+
+	// 0 interprets everything, 1 compiles every function on first use
+	char *jit = getenv("NUA_JIT_THRESHOLD");
+	if (jit) {
+		n->jit_threshold = atoi(jit);
+	}
 	tab *env = nua_new_tab(n);
 
 	func *base = nua_load_file(n, env, args[1]);
@@ -64,20 +76,33 @@ int main(int argn, char **args) {
 		return 1;
 	}
 
-	print_func_def(*base->def);
-	
-	func *print =  gc_alloc(&n->gc_list, sizeof(*print), GC_FUNC);
-	print->type = FUNC_C;
-	print->c_func = &nua_print_val;
+	// Set to print the bytecode of the file before running it
+	if (getenv("NUA_DUMP")) {
+		print_func_def(*base->def);
+	}
 	
-	tab_set(base->env, (val){VAL_STR, .str = intern(&n->gc_list, &n->intern_map, (slice) {
-		.len = 5,
-		.str = "print"})}, 
-		(val){VAL_FUNC, .func = print});
-		
-	val_al_push(&n->stack, (val) {VAL_FUNC, .func = base});
+	nua_set_field(n, base->env, "print", FUNC_VAL(nua_new_c_func(n, &nua_print_val)));
+	nua_open_gc(n, base->env);
+
+	// 0 keeps the array library to scalar code, 1 to SSE2
+	char *simd = getenv("NUA_ARRAY_SIMD");
+	nua_array_simd(simd ? atoi(simd) : 2);
+	nua_open_array(n, base->env);
+
+	val_al_push(&n->stack, FUNC_VAL(base));
 		
 	nua_call(n, 0, 0, 0);
 
+	char *snapshot = getenv("NUA_HEAP_SNAPSHOT");
+	if (snapshot) {
+		FILE *f = fopen(snapshot, "w");
+		if (!f || nua_heap_snapshot(n, f)) {
+			fprintf(stderr, "Unable to write heap snapshot!\n");
+		}
+		if (f) {
+			fclose(f);
+		}
+	}
+
 	return 0;
 }
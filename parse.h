@@ -60,10 +60,10 @@ EXIT:
 
 typedef enum tokt { 
 	// General Token types
-	TOK_ERR, TOK_IDENT, TOK_NUM, TOK_STR, TOK_EOI,
+	TOK_ERR, TOK_IDENT, TOK_NUM, TOK_INT, TOK_STR, TOK_EOI,
 	// Special identifiers
 	TOK_LOCAL, TOK_GLOBAL, TOK_IF, TOK_THEN, TOK_ELSE, TOK_END, TOK_WHILE, TOK_DO, TOK_FUN, TOK_RET,
-	TOK_NIL, TOK_BREAK, TOK_CONTINUE,
+	TOK_NIL, TOK_BREAK, TOK_CONTINUE, TOK_FOR,
 	// Special symbols
 	TOK_ASSIGN, TOK_EQ, TOK_ADD, TOK_SUB, TOK_GE, TOK_GT, TOK_LE, TOK_LT, TOK_TABL, TOK_TABR,
 	TOK_INDL, TOK_INDR, TOK_BRL, TOK_BRR, TOK_COM, TOK_DOT
@@ -78,6 +78,9 @@ typedef struct {
 		struct {
 			double num;
 		};
+		struct {
+			int64_t inum;
+		};
 		struct {
 			char *str;
 		};
@@ -94,7 +97,7 @@ typedef struct {
 	token current;
 	
 	// GC information
-	mem_block *gc_heap;
+	gc_heap *gc_heap;
 	str_map *intern_map;
 } parser;
 
@@ -143,6 +146,7 @@ static inline token parse_symb(parser *p) {
 		};
 	case '>':
 		if (*p->pos == '=') {
+			++p->pos;
 			return (token) {
 				TOK_GE,
 			};
@@ -152,6 +156,7 @@ static inline token parse_symb(parser *p) {
 		};
 	case '<':
 		if (*p->pos == '=') {
+			++p->pos;
 			return (token) {
 				TOK_LE,
 			};
@@ -220,6 +225,7 @@ int parse_init(void) {
 	sident_map_set(&sidents, "nil", TOK_NIL);
 	sident_map_set(&sidents, "break", TOK_BREAK);
 	sident_map_set(&sidents, "continue", TOK_CONTINUE);
+	sident_map_set(&sidents, "for", TOK_FOR);
 	return 0;
 }
 
@@ -293,9 +299,23 @@ static inline token parse_str(parser *p) {
 }
 
 static inline token parse_no(parser *p) {
+	const char *start = p->pos;
+	double num = strtod(start, (char **)&p->pos);
+
+	// Plain digits are integers, when they fit
+	char *end;
+	errno = 0;
+	long long inum = strtoll(start, &end, 10);
+	if (end == p->pos && errno != ERANGE && inum >= VAL_INT_MIN && inum <= VAL_INT_MAX) {
+		return (token) {
+			TOK_INT,
+			.inum = inum
+		};
+	}
+
 	return (token) {
 		TOK_NUM,
-		.num = strtod(p->pos, (char **)&p->pos)
+		.num = num
 	};
 }
 
@@ -357,12 +377,19 @@ typedef struct symbol {
 RH_HASH_MAKE(ident_map, char *, symbol, rh_string_hash, rh_string_eq, 0.9)
 RH_AL_MAKE(scope_al, ident_map)
 
-RH_HASH_MAKE(val_map, val, size_t, val_hash, val_eq, 0.9)
+// Equal numbers of different subtypes are kept as separate literals
+static inline int lit_eq(const val a, const val b) {
+	return VAL_TYPE_OF(a) == VAL_TYPE_OF(b) && val_eq(a, b);
+}
+
+RH_HASH_MAKE(val_map, val, size_t, val_hash, lit_eq, 0.9)
 
 typedef struct {
 	int in_loop; // Loop start may be 0, so a seperate var is needed
 	size_t start; // For continue
 	size_t last_break; // Linked jump list for break
+	int test_end; // Loops testing at the end continue forwards
+	size_t last_continue; // Linked jump list for continue, if test_end
 } loop_data;
 
 typedef struct {
@@ -515,7 +542,6 @@ void set_jump_list(f_data *f, size_t pos, size_t to) {
 	int offset = 0;
 	do {	
 		pos -= offset;
-		print_inst(f->ins.items[pos]);
 		assert(f->ins.items[pos].op == OP_JMP);
 		
 		offset = f->ins.items[pos].off;
@@ -523,6 +549,38 @@ void set_jump_list(f_data *f, size_t pos, size_t to) {
 	} while (offset);
 }	
 
+// Tests a condition, the jump to take when it fails must follow
+void push_test(parser *p, f_data *f, int condition) {
+	// A comparison into a temporary can branch itself, without the value
+	inst *last = inst_list_rpeek(&f->ins);
+	if (last && condition >= f->reg && last->rout == condition) {
+		switch (last->op) {
+		case OP_GT:
+			last->op = OP_TGT;
+			return;
+		case OP_GE:
+			last->op = OP_TGE;
+			return;
+		case OP_GTK:
+			last->op = OP_TGTK;
+			return;
+		case OP_GEK:
+			last->op = OP_TGEK;
+			return;
+		case OP_LTK:
+			last->op = OP_TLTK;
+			return;
+		case OP_LEK:
+			last->op = OP_TLEK;
+			return;
+		default:
+			break;
+		}
+	}
+
+	push_inst(p, f, (inst) {OP_COVER, condition});
+}
+
 int parse_code(parser *p, f_data *f);
 int parse_decl(parser *p, f_data *f);
 int parse_assign(parser *p, f_data *f);
@@ -532,6 +590,7 @@ int parse_pexpr(parser *p, f_data *f);
 int parse_if(parser *p, f_data *f);
 int parse_ret(parser *p, f_data *f);
 int parse_while(parser *p, f_data *f);
+int parse_for(parser *p, f_data *f);
 int parse_break(parser *p, f_data *f);
 int parse_continue(parser *p, f_data *f);
 
@@ -561,6 +620,8 @@ int parse(parser p, func_def *f) {
 	f->lines = fd.lines;
 	f->gc_height = fd.gc_height;
 	f->literals = fd.literals;
+	f->cache = calloc(fd.ins.top, sizeof(*f->cache));
+	f->misses = calloc(fd.ins.top, sizeof(*f->misses));
 	f->file = p.file;
 
 	return 0;
@@ -576,6 +637,9 @@ int parse_code(parser *p, f_data *f) {
 		case TOK_WHILE:
 			err = parse_while(p, f);
 			break;
+		case TOK_FOR:
+			err = parse_for(p, f);
+			break;
 		case TOK_BREAK:
 			err = parse_break(p, f);
 			break;
@@ -621,6 +685,10 @@ int parse_continue(parser *p, f_data *f) {
 	if (!f->loop.in_loop) {
 		return -1;
 	}
+	if (f->loop.test_end) {
+		f->loop.last_continue = linked_jump(p, f, f->loop.last_continue);
+		return 0;
+	}
 	size_t at = f->ins.top;
 	push_inst(p, f, (inst) { OP_JMP, .off = f->loop.start - at });
 
@@ -654,7 +722,7 @@ int parse_while(parser *p, f_data *f) {
 	lex_next(p);
 
 	free_if_temp(f, condition);
-	push_inst(p, f, (inst) {OP_COVER, condition});
+	push_test(p, f, condition);
 
 	size_t jmp_from = f->ins.top;
 	push_inst(p, f, (inst) {OP_JMP});
@@ -678,6 +746,92 @@ int parse_while(parser *p, f_data *f) {
 	return 0;
 }
 
+// for <ident> = <start>, <limit>[, <step>] do ... end
+int parse_for(parser *p, f_data *f) {
+	if (p->current.type != TOK_FOR) {
+		return 1;
+	}
+	add_scope(f);
+	lex_next(p);
+
+	if (p->current.type != TOK_IDENT) {
+		log_error(p, f, "Expected identifier after for\n");
+		return -1;
+	}
+	char *name = lex_claim_lexme(p);
+	lex_next(p);
+
+	if (p->current.type != TOK_ASSIGN) {
+		log_error(p, f, "Expected = after for identifier\n");
+		return -1;
+	}
+	lex_next(p);
+
+	// The counter, limit and step are locals that can not be named, the
+	// variable follows them
+	static const char *hidden[] = {"(for counter)", "(for limit)", "(for step)"};
+	size_t base = f->reg;
+	for (int i = 0;i < 3;++i) {
+		if (i == 2 && p->current.type != TOK_COM) {
+			size_t reg = alloc_local(f, strdup(hidden[i]));
+			push_inst(p, f, (inst) {OP_SETL, reg, alloc_literal(f, INT_VAL(1))});
+			break;
+		}
+		if (i) {
+			if (p->current.type != TOK_COM) {
+				log_error(p, f, "Expected , and for limit\n");
+				return -1;
+			}
+			lex_next(p);
+		}
+
+		if (parse_expr(p, f)) {
+			log_error(p, f, "Invalid for expression\n");
+			return -1;
+		}
+		trans_temp(f, strdup(hidden[i]));
+	}
+	alloc_local(f, name);
+
+	if (p->current.type != TOK_DO) {
+		log_error(p, f, "Expected do token to close for\n");
+		return -1;
+	}
+	lex_next(p);
+
+	size_t prep = f->ins.top;
+	push_inst(p, f, (inst) {OP_FORPREP, ._reg = base});
+
+	loop_data old = f->loop;
+	f->loop = (loop_data) {
+		.in_loop = 1,
+		.test_end = 1,
+	};
+
+	parse_code(p, f);
+
+	size_t loop = f->ins.top;
+	if (loop - prep >= INT16_MAX) {
+		log_error(p, f, "For loop body too long\n");
+		return -1;
+	}
+	push_inst(p, f, (inst) {OP_FORLOOP, ._reg = base, .ilit = prep + 1 - loop});
+	f->ins.items[prep].ilit = f->ins.top - prep;
+
+	set_jump_list(f, f->loop.last_continue, loop);
+	set_jump_list(f, f->loop.last_break, f->ins.top);
+	f->loop = old;
+
+	if (p->current.type != TOK_END) {
+		return -1;
+	}
+	lex_next(p);
+
+	rem_scope(f);
+
+	return 0;
+}
+
 int parse_if(parser *p, f_data *f) {
 	if (p->current.type != TOK_IF) {
 		return 1;
@@ -697,7 +851,7 @@ int parse_if(parser *p, f_data *f) {
 	lex_next(p);
 
 	free_if_temp(f, condition);
-	push_inst(p, f, (inst) {OP_COVER, condition});
+	push_test(p, f, condition);
 	
 	size_t if_start = f->ins.top;
 	push_inst(p, f, (inst) {OP_JMP});
@@ -735,6 +889,7 @@ int parse_ret(parser *p, f_data *f) {
 	lex_next(p);
 	
 	int start = f->reg;
+	size_t first = f->ins.top;
 
 	if (parse_expr(p, f)) {
 		return -1;
@@ -754,6 +909,14 @@ int parse_ret(parser *p, f_data *f) {
 		free_temp(f);
 	}
 
+	// A call in tail position replaces this function's frame, the return
+	// is still needed by any jumps past the call
+	inst *last = inst_list_rpeek(&f->ins);
+	if (no_ret == 1 && f->ins.top > first
+	&&  last->op == OP_CALL && last->rout == start) {
+		last->op = OP_TAILCALL;
+	}
+
 	push_inst(p, f, (inst) {OP_RET, .rout = no_ret, .rina = start});
 
 	return 0;
@@ -818,11 +981,9 @@ int parse_decl(parser *p, f_data *f) {
 		char *ident = id.items[t++];
 		size_t reg = top_or_local(f);
 		add_global(f, ident);
-		push_inst(p, f, (inst) {OP_SENV, reg, alloc_literal(f, (val) {VAL_STR,
-						.str = intern(p->gc_heap, p->intern_map, (slice) {
+		push_inst(p, f, (inst) {OP_SENV, reg, alloc_literal(f, STR_VAL(intern(p->gc_heap, p->intern_map, (slice) {
 							.len = strlen(ident),
-							.str = ident })
-						})
+							.str = ident })))
 		});
 
 		free_if_temp(f, reg);
@@ -846,11 +1007,9 @@ int parse_decl(parser *p, f_data *f) {
 			char *ident = id.items[t++];
 			size_t reg = top_or_local(f);
 			add_global(f, ident);
-			push_inst(p, f, (inst) {OP_SENV, reg, alloc_literal(f, (val) {VAL_STR,
-							.str = intern(p->gc_heap, p->intern_map, (slice) {
+			push_inst(p, f, (inst) {OP_SENV, reg, alloc_literal(f, STR_VAL(intern(p->gc_heap, p->intern_map, (slice) {
 								.len = strlen(ident),
-								.str = ident })
-							})
+								.str = ident })))
 			});
 
 			free_if_temp(f, reg);
@@ -873,11 +1032,9 @@ int parse_decl(parser *p, f_data *f) {
 			if (is_global) {
 				char *ident = id.items[t++];
 				add_global(f, ident);
-				push_inst(p, f, (inst) {OP_SENV, f->reg + (i->rinb - (id.top - t)), alloc_literal(f, (val) {VAL_STR,
-								.str = intern(p->gc_heap, p->intern_map, (slice) {
+				push_inst(p, f, (inst) {OP_SENV, f->reg + (i->rinb - (id.top - t)), alloc_literal(f, STR_VAL(intern(p->gc_heap, p->intern_map, (slice) {
 									.len = strlen(ident),
-									.str = ident })
-								})
+									.str = ident })))
 				});
 			} else {
 				alloc_local(f, id.items[t++]);
@@ -893,7 +1050,7 @@ int parse_decl(parser *p, f_data *f) {
 	return 0;
 }
 
-enum ass_type { ASS_ERR, ASS_LOCAL, ASS_ENV, ASS_TAB };
+enum ass_type { ASS_ERR, ASS_LOCAL, ASS_ENV, ASS_TAB, ASS_FIELD };
 typedef struct assign {
 	uint8_t type;
 	union {
@@ -957,6 +1114,13 @@ int parse_assign(parser *p, f_data *f) {
 			}
 			ass_al_push(&a, (assign) {ASS_TAB, .rtab = i.rina, .rkey = i.rinb});
 			break;
+		case OP_GETF:
+			// Tab, with the key a literal
+			if (!is_local(f, i.rina)) {
+				alloc_temp(f);
+			}
+			ass_al_push(&a, (assign) {ASS_FIELD, .rtab = i.rina, .rkey = i.rinb});
+			break;
 		default:
 			log_error(p, f, "Error non-assignable primary expression in assignment\n");
 			print_inst(i);
@@ -1004,6 +1168,10 @@ int parse_assign(parser *p, f_data *f) {
 			inst_list_push(&tabs_envs, (inst) { OP_STAB, .rout = a.items[t].rtab,
 				.rina = a.items[t].rkey, .rinb = top_or_local(f)});
 			break;
+		case ASS_FIELD:
+			inst_list_push(&tabs_envs, (inst) { OP_SETF, .rout = a.items[t].rtab,
+				.rina = top_or_local(f), .rinb = a.items[t].rkey});
+			break;
 		}
 		
 		++t;
@@ -1046,6 +1214,9 @@ int parse_assign(parser *p, f_data *f) {
 				// Reg is still availible for computation
 				push_inst(p, f, (inst) {OP_GTAB, .rout = reg, .rina = ins.rout, .rinb = ins.rina});
 				push_inst(p, f, (inst) {assign_op, .rout = ins.rinb, .rina = ins.rinb, .rinb =  reg});
+			case OP_SETF:
+				push_inst(p, f, (inst) {OP_GETF, .rout = reg, .rina = ins.rout, .rinb = ins.rinb});
+				push_inst(p, f, (inst) {assign_op, .rout = ins.rina, .rina = ins.rina, .rinb =  reg});
 			case OP_SENV:
 				push_inst(p, f, (inst) {OP_GENV, .reg = reg, .lit = ins.lit});
 				push_inst(p, f, (inst) {assign_op, .rout = ins.rinb, .rina = ins.rinb, .rinb =  reg});
@@ -1089,7 +1260,8 @@ void claim_temps(f_data *f, inst ins) {
 		if (!is_local(f, ins.rinb)) {
 			alloc_temp(f);
 		}
-	case OPT_RR: // Fallthrough
+	case OPT_RRK: // Fallthrough
+	case OPT_RR:
 		if (!is_local(f, ins.rina)) {
 			alloc_temp(f);
 		}
@@ -1112,7 +1284,8 @@ int redirect(inst op, int redir_reg, inst_list ops) {
 				ins.rinb = redir_reg;
 				redir = 1;
 			}
-		case OPT_RR: // Fallthrough
+		case OPT_RRK: // Fallthrough
+		case OPT_RR:
 			if (ins.rina == reg) {
 				ins.rina = redir_reg;
 				redir = 1;
@@ -1131,29 +1304,84 @@ int redirect(inst op, int redir_reg, inst_list ops) {
 	return redir;
 }
 
+// Gives the literal just loaded into a temporary, if it is a number that
+// can be the operand of a K op, otherwise -1
+static int number_literal(f_data *f, int reg) {
+	inst *last = inst_list_rpeek(&f->ins);
+	if (!last || is_local(f, reg) || last->op != OP_SETL || last->reg != reg
+	||  last->lit > UINT8_MAX || !IS_NUMBER(f->literals.items[last->lit])) {
+		return -1;
+	}
+	return last->lit;
+}
+
 int emit_bin_code(parser *p, f_data *f, tokt op, int left, int right) {
+	// The load of a number literal can be folded into the op, only the
+	// last instruction can be such a load
+	int kl = op != TOK_SUB ? number_literal(f, left) : -1;
+	int kr = number_literal(f, right);
+	if (kl >= 0 || kr >= 0) {
+		pop_inst(f);
+	}
+
 	free_if_temp(f, right);
 	free_if_temp(f, left);
 		
 	int out = alloc_temp(f);
 	switch (op) {
 	case TOK_ADD:
-		push_inst(p, f, (inst) {OP_ADD, .rout = out, .rina = left, .rinb =  right});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_ADDK, .rout = out, .rina = left, .rinb = kr});
+		} else if (kl >= 0) {
+			push_inst(p, f, (inst) {OP_ADDK, .rout = out, .rina = right, .rinb = kl});
+		} else {
+			push_inst(p, f, (inst) {OP_ADD, .rout = out, .rina = left, .rinb =  right});
+		}
 		break;
 	case TOK_SUB:
-		push_inst(p, f, (inst) {OP_SUB, .rout = out, .rina = left, .rinb =  right});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_SUBK, .rout = out, .rina = left, .rinb = kr});
+		} else {
+			push_inst(p, f, (inst) {OP_SUB, .rout = out, .rina = left, .rinb =  right});
+		}
 		break;
+	// The K forms give the same value as the GT formulation, so a < k
+	// gives a and k < a gives k
 	case TOK_LT:
-		push_inst(p, f, (inst) {OP_GT, .rout = out, .rina = right, .rinb =  left});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_LTK, .rout = out, .rina = left, .rinb = kr});
+		} else if (kl >= 0) {
+			push_inst(p, f, (inst) {OP_GTK, .rout = out, .rina = right, .rinb = kl});
+		} else {
+			push_inst(p, f, (inst) {OP_GT, .rout = out, .rina = right, .rinb =  left});
+		}
 		break;
 	case TOK_GT:
-		push_inst(p, f, (inst) {OP_GT, .rout = out, .rina = left, .rinb =  right});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_GTK, .rout = out, .rina = left, .rinb = kr});
+		} else if (kl >= 0) {
+			push_inst(p, f, (inst) {OP_LTK, .rout = out, .rina = right, .rinb = kl});
+		} else {
+			push_inst(p, f, (inst) {OP_GT, .rout = out, .rina = left, .rinb =  right});
+		}
 		break;
 	case TOK_LE:
-		push_inst(p, f, (inst) {OP_GE, .rout = out, .rina = right, .rinb =  left});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_LEK, .rout = out, .rina = left, .rinb = kr});
+		} else if (kl >= 0) {
+			push_inst(p, f, (inst) {OP_GEK, .rout = out, .rina = right, .rinb = kl});
+		} else {
+			push_inst(p, f, (inst) {OP_GE, .rout = out, .rina = right, .rinb =  left});
+		}
 		break;
 	case TOK_GE:
-		push_inst(p, f, (inst) {OP_GE, .rout = out, .rina = left, .rinb =  right});
+		if (kr >= 0) {
+			push_inst(p, f, (inst) {OP_GEK, .rout = out, .rina = left, .rinb = kr});
+		} else if (kl >= 0) {
+			push_inst(p, f, (inst) {OP_LEK, .rout = out, .rina = right, .rinb = kl});
+		} else {
+			push_inst(p, f, (inst) {OP_GE, .rout = out, .rina = left, .rinb =  right});
+		}
 		break;
 	default:
 		break;
@@ -1215,6 +1443,7 @@ int parse_tab(parser *p, f_data *f) {
 	}
 	lex_next(p);
 
+	size_t start = f->ins.top;
 	push_inst(p, f, (inst) {OP_TAB, reg});
 
 	while (!parse_expr(p, f)) {
@@ -1239,91 +1468,122 @@ int parse_tab(parser *p, f_data *f) {
 	}
 	lex_next(p);
 
+	// Items that are all number or string literals make a literal table,
+	// which instances share until they are written to
+	int constant = f->ins.top > start + 1;
+	for (size_t i = start + 1;constant && i < f->ins.top;i += 2) {
+		inst load = f->ins.items[i];
+		constant = load.op == OP_SETL && i + 1 < f->ins.top
+			&& f->ins.items[i + 1].op == OP_PTAB && f->ins.items[i + 1].rina == load.reg
+			&& (IS_NUMBER(f->literals.items[load.lit]) || IS_STR(f->literals.items[load.lit]));
+	}
+	if (constant) {
+		tab *t = gc_alloc(p->gc_heap, sizeof(tab), GC_TAB);
+		for (size_t i = start + 1;i < f->ins.top;i += 2) {
+			tab_push(t, f->literals.items[f->ins.items[i].lit]);
+		}
+		gc_tab_storage(p->gc_heap, t);
+		while (f->ins.top > start) {
+			pop_inst(f);
+		}
+		push_inst(p, f, (inst) {OP_SETL, reg, alloc_literal(f, TAB_VAL(t))});
+	}
+
 	return 0;
 }
 
 int parse_cont(parser *p, f_data *f) {
-	switch (p->current.type) {
-	case TOK_INDL:{
-		int prefix = top_or_local(f);
-		lex_next(p);
+	// Suffixes may be chained, e.g. a.b[c](d)
+	while (1) {
+		switch (p->current.type) {
+		case TOK_INDL:{
+			int prefix = top_or_local(f);
+			lex_next(p);
 
-		parse_expr(p, f);
-		if (p->current.type != TOK_INDR) {
-			return -1;
-		}
-		lex_next(p);
-		
-		int index = top_or_local(f);
-		free_if_temp(f, index);
-		free_if_temp(f, prefix);
+			parse_expr(p, f);
+			if (p->current.type != TOK_INDR) {
+				return -1;
+			}
+			lex_next(p);
+			
+			int index = top_or_local(f);
+			free_if_temp(f, index);
+			free_if_temp(f, prefix);
 
-		int out = alloc_temp(f);
-		push_inst(p, f, (inst) {OP_GTAB, .rout = out, .rina = prefix, .rinb = index});
+			int out = alloc_temp(f);
+			push_inst(p, f, (inst) {OP_GTAB, .rout = out, .rina = prefix, .rinb = index});
 
-		break;
-	}
-	case TOK_DOT:{
-		int prefix = top_or_local(f);
-		lex_next(p);
-		if (p->current.type != TOK_IDENT) {
-			return -1;
+			break;
 		}
+		case TOK_DOT:{
+			int prefix = top_or_local(f);
+			lex_next(p);
+			if (p->current.type != TOK_IDENT) {
+				return -1;
+			}
 
-		char *ident = lex_claim_lexme(p);
-		lex_next(p);
-		
-		int index = alloc_temp(f);
-		push_inst(p, f, (inst) {OP_SETL, index, alloc_literal(f, (val) {VAL_STR,
-					.str = intern(p->gc_heap, p->intern_map, (slice) {
+			char *ident = lex_claim_lexme(p);
+			lex_next(p);
+			
+			int key = alloc_literal(f, STR_VAL(intern(p->gc_heap, p->intern_map, (slice) {
 						.len = strlen(ident),
-						.str = ident })
-					})
-				});
-		free(ident);
-		
-		free_temp(f /*index*/);
-		free_if_temp(f, prefix);
-		
-		int out = alloc_temp(f);
-		push_inst(p, f, (inst) {OP_GTAB, .rout = out, .rina = prefix, .rinb = index});
+						.str = ident })));
+			free(ident);
 
-		break;
-	}
-	case TOK_BRL:{
-		int prefix = top(f);
-		lex_next(p);
+			// The key is usually small enough to go in the op
+			if (key <= UINT8_MAX) {
+				free_if_temp(f, prefix);
 
-		size_t no_args = 0;
-		if (p->current.type != TOK_BRR) {
-			do {
-				++no_args;
-				if (parse_expr(p, f)) {		
-					log_error(p, f, "Expected an expression in function call\n");
-					return 1;
-				}
+				int out = alloc_temp(f);
+				push_inst(p, f, (inst) {OP_GETF, .rout = out, .rina = prefix, .rinb = key});
+				break;
+			}
+			
+			int index = alloc_temp(f);
+			push_inst(p, f, (inst) {OP_SETL, index, key});
+			
+			free_temp(f /*index*/);
+			free_if_temp(f, prefix);
+			
+			int out = alloc_temp(f);
+			push_inst(p, f, (inst) {OP_GTAB, .rout = out, .rina = prefix, .rinb = index});
 
-			} while (p->current.type == TOK_COM && lex_next(p));
-		}
-		
-		if (p->current.type != TOK_BRR) {
-			log_error(p, f, "Expected right bracket to close function call\n");
-			return -1;
+			break;
 		}
-		lex_next(p);
+		case TOK_BRL:{
+			int prefix = top(f);
+			lex_next(p);
+
+			size_t no_args = 0;
+			if (p->current.type != TOK_BRR) {
+				do {
+					++no_args;
+					if (parse_expr(p, f)) {		
+						log_error(p, f, "Expected an expression in function call\n");
+						return 1;
+					}
+
+				} while (p->current.type == TOK_COM && lex_next(p));
+			}
 			
-		for (int i = 0;i < no_args;++i) {
-			free_temp(f);
-		}
-	
-		// No allocation needed for the return as prefix is not freed
-		push_inst(p, f, (inst) {OP_CALL, .rout = prefix, .rina = no_args, .rinb = 1});
+			if (p->current.type != TOK_BRR) {
+				log_error(p, f, "Expected right bracket to close function call\n");
+				return -1;
+			}
+			lex_next(p);
+				
+			for (int i = 0;i < no_args;++i) {
+				free_temp(f);
+			}
+		
+			// No allocation needed for the return as prefix is not freed
+			push_inst(p, f, (inst) {OP_CALL, .rout = prefix, .rina = no_args, .rinb = 1});
 
-		break;
-	}default:
-		break;
+			break;
+		}default:
+			return 0;
+		}
 	}
-	return 0;
 }
 
 int parse_fun(parser *p, f_data *f) {
@@ -1366,6 +1626,8 @@ int parse_fun(parser *p, f_data *f) {
 	if (p->current.type != TOK_END) {
 		return -1;
 	}
+	// Falling off the end returns nothing
+	push_inst(p, &fd, (inst) {OP_RET});
 	lex_next(p);
 
 	func_def *fun_def = gc_alloc(p->gc_heap, sizeof(*fun_def), GC_FUNCDEF);
@@ -1375,6 +1637,8 @@ int parse_fun(parser *p, f_data *f) {
 	fun_def->lines = fd.lines;
 	fun_def->gc_height = fd.gc_height;
 	fun_def->literals = fd.literals;
+	fun_def->cache = calloc(fd.ins.top, sizeof(*fun_def->cache));
+	fun_def->misses = calloc(fd.ins.top, sizeof(*fun_def->misses));
 
 	fun_def->file = p->file;
 
@@ -1383,7 +1647,7 @@ int parse_fun(parser *p, f_data *f) {
 	fun->def = fun_def;
 
 	push_inst(p, f, (inst) { OP_SETL, reg
-		, alloc_literal(f, (val) { VAL_FUNC, .func = fun })});
+		, alloc_literal(f, FUNC_VAL(fun))});
 
 	return 0;
 }
@@ -1396,7 +1660,12 @@ int parse_pexpr(parser *p, f_data *f) {
 		break;
 	case TOK_NUM:
 		push_inst(p, f, (inst) {OP_SETL, alloc_temp(f)
-			, alloc_literal(f, (val) {VAL_NUM, p->current.num})});
+			, alloc_literal(f, NUM_VAL(p->current.num))});
+		lex_next(p);
+		break;
+	case TOK_INT:
+		push_inst(p, f, (inst) {OP_SETL, alloc_temp(f)
+			, alloc_literal(f, INT_VAL(p->current.inum))});
 		lex_next(p);
 		break;
 	case TOK_TABL:
@@ -1414,12 +1683,10 @@ int parse_pexpr(parser *p, f_data *f) {
 		case ST_ENV:
 			{
 				char *ident = lex_claim_lexme(p);
-				int lit = alloc_literal(f, (val) {VAL_STR,
-					.str = intern(p->gc_heap, p->intern_map, (slice) {
+				int lit = alloc_literal(f, STR_VAL(intern(p->gc_heap, p->intern_map, (slice) {
 						.len = strlen(ident),
 						.str = ident,
-					})
-				});
+					})));
 				free(ident);
 				push_inst(p, f, (inst) {OP_GENV, .reg = alloc_temp(f), .lit = lit});
 				break;
@@ -0,0 +1,125 @@
+#ifndef NUA_SNAPSHOT_H
+#define NUA_SNAPSHOT_H
+
+#include <inttypes.h>
+
+// Heap snapshots are written as text, one record per line, and can be read
+// with tools/heap_dom to find what is holding onto memory
+//   nua-heap 1
+//   r <id>				a root on the stack
+//   o <id> <type> <size> <no edges> <edge id>... [<file>:<line>]
+// Ids are object addresses in hex. Sizes include any storage owned by the
+// object, and function definitions end with where they were defined
+
+static size_t snapshot_count(val *v, size_t no) {
+	size_t edges = 0;
+	for (size_t i = 0;i < no;++i) {
+		edges += val_block(v[i]) != NULL;
+	}
+	return edges;
+}
+
+static void snapshot_edges(FILE *out, val *v, size_t no) {
+	for (size_t i = 0;i < no;++i) {
+		mem_block *b = val_block(v[i]);
+		if (b) {
+			fprintf(out, " %" PRIxPTR, (uintptr_t)b);
+		}
+	}
+}
+
+static void snapshot_obj(mem_block *b, void *data) {
+	FILE *out = data;
+	size_t size = b->size;
+
+	switch (b->tag) {
+	case GC_TAB: {
+		tab *t = (tab *)b;
+		if (t->proto) {
+			fprintf(out, "o %" PRIxPTR " tab %zu 1 %" PRIxPTR, (uintptr_t)b, size, (uintptr_t)t->proto);
+			break;
+		}
+
+		size_t vals = t->kind == TAB_VALS ? t->al.top : 0;
+		size_t edges = snapshot_count(t->al.items, vals);
+		size_t buckets = tab_hash_slots(&t->ht);
+
+		size += tab_storage(t);
+		for (size_t i = 0;i < buckets;++i) {
+			val_ht_bucket *b = tab_hash_at(&t->ht, i);
+			if (b) {
+				edges += snapshot_count(&b->key, 1);
+				edges += snapshot_count(&b->value, 1);
+			}
+		}
+		if (t->shape) {
+			edges += t->shape->no + snapshot_count(t->slots, t->shape->no);
+		}
+
+		fprintf(out, "o %" PRIxPTR " tab %zu %zu", (uintptr_t)b, size, edges);
+		snapshot_edges(out, t->al.items, vals);
+		for (size_t i = 0;i < buckets;++i) {
+			val_ht_bucket *b = tab_hash_at(&t->ht, i);
+			if (b) {
+				snapshot_edges(out, &b->key, 1);
+				snapshot_edges(out, &b->value, 1);
+			}
+		}
+		for (shape *s = t->shape;s;s = s->parent) {
+			fprintf(out, " %" PRIxPTR, (uintptr_t)s->key);
+		}
+		snapshot_edges(out, t->slots, t->shape ? t->shape->no : 0);
+		break;
+	} case GC_FUNC: {
+		func *f = (func *)b;
+		if (f->type != FUNC_NUA) {
+			fprintf(out, "o %" PRIxPTR " func %zu 0", (uintptr_t)b, size);
+			break;
+		}
+
+		fprintf(out, "o %" PRIxPTR " func %zu %d", (uintptr_t)b, size, f->env ? 2 : 1);
+		if (f->env) {
+			fprintf(out, " %" PRIxPTR, (uintptr_t)f->env);
+		}
+		fprintf(out, " %" PRIxPTR, (uintptr_t)f->def);
+		break;
+	} case GC_FUNCDEF: {
+		func_def *d = (func_def *)b;
+		size += d->ins.size * sizeof(inst);
+		size += d->literals.size * sizeof(val);
+		size += (d->lines.size + d->gc_height.size) * sizeof(int);
+		size += d->ins.top * (sizeof(*d->cache) + sizeof(*d->misses));
+#ifdef NUA_JIT
+		size += d->jit ? d->jit->size + d->ins.top * sizeof(*d->jit->entry) : 0;
+#endif
+
+		fprintf(out, "o %" PRIxPTR " funcdef %zu %zu", (uintptr_t)b, size
+				, snapshot_count(d->literals.items, d->literals.top));
+		snapshot_edges(out, d->literals.items, d->literals.top);
+		fprintf(out, " %s:%d", d->file ? d->file : "?", d->lines.top ? d->lines.items[0] : 0);
+		break;
+	} default:
+		fprintf(out, "o %" PRIxPTR " %s %zu 0", (uintptr_t)b, gc_mem_type_str[(int)b->tag], size);
+		break;
+	}
+
+	fputc('\n', out);
+}
+
+// Values on the stack up to its top are taken as the roots
+int nua_heap_snapshot(nua_state *n, FILE *out) {
+	fprintf(out, "nua-heap 1\n");
+
+	for (size_t i = 0;i < n->stack.top;++i) {
+		mem_block *b = val_block(n->stack.items[i]);
+		if (b) {
+			fprintf(out, "r %" PRIxPTR "\n", (uintptr_t)b);
+		}
+	}
+
+	gc_each(&n->gc, &snapshot_obj, out);
+
+	return ferror(out) ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Times each operation of the array library against the same loop in Nua,
+# over an array of a million doubles, with the kernels at every level.
+# There is no multiply in Nua, so dot and scale have no loop to compare
+#   sh tests/array_bench.sh [path to nua]
+
+nua=${1:-./nua}
+dir=$(mktemp -d)
+reps=100
+
+# Script for one operation, given the body of the repeated loop
+bench() {
+	cat > "$dir/$1.nua" <<END
+global print, array
+local a = {}
+local b = {}
+for i = 0, 999999 do
+	a[i] = i + 0.5
+	b[i] = 0.25
+end
+local s = 0
+for r = 1, $reps do
+$2
+end
+print(s)
+END
+}
+
+bench sum_loop '	for i = 0, 999999 do
+		s = s + a[i]
+	end'
+bench sum_array '	s = s + array.sum(a)'
+bench max_loop '	for i = 0, 999999 do
+		if s < a[i] then
+			s = a[i]
+		end
+	end'
+bench max_array '	s = array.max(a)'
+bench add_loop '	for i = 0, 999999 do
+		a[i] = a[i] + b[i]
+	end'
+bench add_array '	array.add(a, b)'
+bench fill_loop '	for i = 0, 999999 do
+		a[i] = 1.5
+	end'
+bench fill_array '	array.fill(a, 1.5)'
+bench copy_loop '	for i = 0, 999999 do
+		b[i] = a[i]
+	end'
+bench copy_array '	array.copy(b, a)'
+bench prefix_loop '	s = 0
+	for i = 0, 999999 do
+		s = s + b[i]
+		b[i] = s
+	end'
+bench prefix_array '	array.prefix(b)'
+bench dot_array '	s = s + array.dot(a, b)'
+bench scale_array '	array.scale(a, 1.5)'
+
+# Setting up the arrays is timed on its own and taken off
+bench none ''
+
+run() {
+	start=$(date +%s%N)
+	NUA_ARRAY_SIMD=$2 "$nua" "$dir/$1.nua" > /dev/null
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+base=$(run none 2)
+printf "%-8s %8s %8s %8s %8s   (ms for %d runs, less %dms set up)\n" op loop scalar sse2 avx2 $reps $base
+for op in sum max add fill copy prefix dot scale; do
+	loop=-
+	if [ -f "$dir/${op}_loop.nua" ]; then
+		loop=$(( $(run ${op}_loop 2) - base ))
+	fi
+	printf "%-8s %8s" $op $loop
+	for level in 0 1 2; do
+		printf " %8s" $(( $(run ${op}_array $level) - base ))
+	done
+	echo
+done
+
+rm -rf "$dir"
@@ -0,0 +1,92 @@
+// Interns millions of distinct strings from C, as a running program making
+// keys would, keeping one in every 100000 alive in a rooted table. Each is
+// also added to a new table after the one made 10000 before it, and the
+// table must find both again. Neither the intern table nor the shape tree
+// keep strings alive, and the shape tree stops growing at SHAPE_TREE_MAX, so
+// the heap and RSS should stay flat however many go through. Prints the peak
+// RSS in KB
+//   cc -O2 -std=c11 tests/intern_soak.c -o intern_soak -lm
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "../gc.h"
+#include "../val.h"
+#include "../parse.h"
+#include "../core_api.h"
+
+#define SOAK_STRINGS 3000000
+#define SOAK_KEEP 100000
+#define SOAK_RECENT 10000
+
+static long peak_rss(void) {
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "VmHWM:", 6)) {
+			kb = atol(line + 6);
+		}
+	}
+	if (f) {
+		fclose(f);
+	}
+	return kb;
+}
+
+static interned_str *soak_str(nua_state *n, long i) {
+	char buf[64];
+	int len = sprintf(buf, "transient-key-%ld", i);
+	return intern(&n->gc, &n->intern_map, (slice) {len, buf});
+}
+
+int main(void) {
+	nua_state *n = nua_new_state();
+	tab *keep = nua_new_tab(n);
+	tab *recent = nua_new_tab(n);
+	val_al_push(&n->stack, TAB_VAL(keep));
+	val_al_push(&n->stack, TAB_VAL(recent));
+	val_al_push(&n->stack, NIL_VAL);
+	val_al_push(&n->stack, NIL_VAL);
+	for (long i = 0;i < SOAK_RECENT;++i) {
+		nua_tab_set(n, recent, INT_VAL(i), STR_VAL(soak_str(n, i - SOAK_RECENT)));
+	}
+
+	for (long i = 0;i < SOAK_STRINGS;++i) {
+		interned_str *s = soak_str(n, i);
+		n->stack.items[2] = STR_VAL(s);
+		if (i % SOAK_KEEP == 0) {
+			nua_tab_set(n, keep, INT_VAL(i / SOAK_KEEP), STR_VAL(s));
+		}
+
+		// Keys go in pairs no table had before, each needing new shapes
+		tab *t = nua_new_tab(n);
+		n->stack.items[3] = TAB_VAL(t);
+		val old = tab_get(recent, INT_VAL(i % SOAK_RECENT));
+		nua_tab_set(n, t, old, INT_VAL(i));
+		nua_tab_set(n, t, STR_VAL(s), INT_VAL(i));
+		if (!IS_INT(tab_get(t, old)) || !IS_INT(tab_get(t, STR_VAL(s)))) {
+			printf("Key %ld was lost!\n", i);
+			return 1;
+		}
+		nua_tab_set(n, recent, INT_VAL(i % SOAK_RECENT), STR_VAL(s));
+		gc_check(n, 1);
+	}
+
+	// Kept strings must still be the ones intern gives
+	for (long i = 0;i < SOAK_STRINGS;i += SOAK_KEEP) {
+		val v = tab_get(keep, INT_VAL(i / SOAK_KEEP));
+		if (!IS_STR(v) || AS_STR(v) != soak_str(n, i)) {
+			printf("Kept string %ld was lost!\n", i);
+			return 1;
+		}
+	}
+
+	printf("%ld\n", peak_rss());
+	return 0;
+}
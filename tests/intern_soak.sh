@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds and runs intern_soak.c, whose peak RSS must stay under the bound
+# in KB. CFLAGS are passed on to cc
+#   sh tests/intern_soak.sh [bound]
+
+dir=$(dirname "$0")
+bound=${1:-16384}
+out=$(mktemp -d)
+fail=0
+
+if cc -O2 -std=c11 $CFLAGS "$dir/intern_soak.c" -o "$out/intern_soak" -lm \
+		&& rss=$("$out/intern_soak") && [ "$rss" -le "$bound" ]; then
+	echo "ok   intern_soak (${rss}KB)"
+else
+	echo "FAIL intern_soak ${rss:+(${rss}KB, over ${bound}KB)}"
+	fail=1
+fi
+
+rm -rf "$out"
+exit $fail
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs every script in tests/ interpreted only and with every function
+# compiled on first use, the outputs must be the same, and match
+# <script>.expected where there is one. Then runs the intern soak test
+#   sh tests/jit_test.sh [path to nua]
+
+nua=${1:-./nua}
+dir=$(dirname "$0")
+out=$(mktemp -d)
+fail=0
+
+# Scripts reading gc.stats() are skipped when statistics are compiled out
+cat > "$out/stats.nua" <<EOF
+global print, gc
+if gc.stats().recorded then
+	print(1)
+end
+EOF
+stats=$("$nua" "$out/stats.nua")
+
+for t in "$dir"/*.nua; do
+	name=$(basename "$t" .nua)
+	if [ -z "$stats" ] && grep -q "gc.stats" "$t"; then
+		echo "skip $name"
+		continue
+	fi
+	NUA_JIT_THRESHOLD=0 "$nua" "$t" > "$out/$name.interp" 2>&1
+	NUA_JIT_THRESHOLD=1 "$nua" "$t" > "$out/$name.jit" 2>&1
+	if [ -f "$dir/$name.expected" ] && ! cmp -s "$dir/$name.expected" "$out/$name.interp"; then
+		echo "FAIL $name"
+		diff "$dir/$name.expected" "$out/$name.interp" | head -20
+		fail=1
+	elif cmp -s "$out/$name.interp" "$out/$name.jit"; then
+		echo "ok   $name"
+	else
+		echo "FAIL $name"
+		diff "$out/$name.interp" "$out/$name.jit" | head -20
+		fail=1
+	fi
+done
+
+rm -rf "$out"
+
+# Strings made from C, which no script can yet
+sh "$dir/intern_soak.sh" || fail=1
+
+exit $fail
@@ -0,0 +1,339 @@
+// Reads a heap snapshot written by nua_heap_snapshot and reports the objects
+// retaining the most memory, using the dominator tree of the heap graph.
+// An object's retained size is what would be freed if it became unreachable
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct node {
+	uintptr_t id;
+	char type[16];
+	char loc[64];
+	size_t size;
+	size_t retained;
+	size_t edge, no_edges;
+	size_t order;			// Reverse postorder number, 0 if unreachable
+	size_t idom;
+} node;
+
+static node *nodes;
+static size_t no_nodes, max_nodes;
+
+// Edges are stored flat, first as ids then resolved to node indices
+static uintptr_t *edges;
+static size_t no_edges, max_edges;
+
+static uintptr_t *roots;
+static size_t no_roots, max_roots;
+
+#define GROW(a, no, max) do { \
+	if ((no) >= (max)) { \
+		(max) = (max) ? (max) * 2 : 64; \
+		(a) = realloc((a), (max) * sizeof(*(a))); \
+		if (!(a)) { \
+			fprintf(stderr, "Out of memory!\n"); \
+			exit(1); \
+		} \
+	} \
+} while (0)
+
+static int read_snapshot(FILE *in) {
+	char buf[64];
+	int ver;
+	if (fscanf(in, "%63s %d", buf, &ver) != 2 || strcmp(buf, "nua-heap") || ver != 1) {
+		fprintf(stderr, "Not a version 1 heap snapshot!\n");
+		return 1;
+	}
+
+	while (fscanf(in, "%63s", buf) == 1) {
+		if (!strcmp(buf, "r")) {
+			GROW(roots, no_roots, max_roots);
+			if (fscanf(in, "%" SCNxPTR, &roots[no_roots++]) != 1) {
+				break;
+			}
+			continue;
+		} else if (strcmp(buf, "o")) {
+			fprintf(stderr, "Unknown record %s!\n", buf);
+			return 1;
+		}
+
+		GROW(nodes, no_nodes, max_nodes);
+		node *o = &nodes[no_nodes++];
+		memset(o, 0, sizeof(*o));
+		if (fscanf(in, "%" SCNxPTR " %15s %zu %zu", &o->id, o->type, &o->size, &o->no_edges) != 4) {
+			break;
+		}
+
+		o->edge = no_edges;
+		for (size_t i = 0;i < o->no_edges;++i) {
+			GROW(edges, no_edges, max_edges);
+			if (fscanf(in, "%" SCNxPTR, &edges[no_edges++]) != 1) {
+				fprintf(stderr, "Truncated snapshot!\n");
+				return 1;
+			}
+		}
+
+		// Anything left on the line is the location
+		int c = getc(in);
+		if (c == ' ') {
+			if (!fgets(o->loc, sizeof(o->loc), in)) {
+				break;
+			}
+			o->loc[strcspn(o->loc, "\n")] = '\0';
+		} else {
+			ungetc(c, in);
+		}
+	}
+
+	if (ferror(in) || !feof(in)) {
+		fprintf(stderr, "Malformed snapshot!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int node_cmp(const void *a, const void *b) {
+	uintptr_t x = ((node *)a)->id, y = ((node *)b)->id;
+	return (x > y) - (x < y);
+}
+
+static int id_cmp(const void *key, const void *n) {
+	uintptr_t x = *(uintptr_t *)key, y = ((node *)n)->id;
+	return (x > y) - (x < y);
+}
+
+// Returns no_nodes for ids with no object, such as the nursery after a copy
+static size_t find(uintptr_t id) {
+	node *n = bsearch(&id, nodes, no_nodes, sizeof(*nodes), id_cmp);
+	return n ? (size_t)(n - nodes) : no_nodes;
+}
+
+// The virtual root is the last node, pointing to every root
+static size_t add_root(void) {
+	GROW(nodes, no_nodes, max_nodes);
+	node *r = &nodes[no_nodes];
+	memset(r, 0, sizeof(*r));
+	strcpy(r->type, "root");
+	r->edge = no_edges;
+	for (size_t i = 0;i < no_roots;++i) {
+		GROW(edges, no_edges, max_edges);
+		edges[no_edges++] = roots[i];
+		r->no_edges++;
+	}
+	return no_nodes++;
+}
+
+static size_t *rpo;			// Nodes in reverse postorder
+static size_t no_rpo;
+
+static size_t *pred, *pred_start;
+
+// Numbers reachable nodes in reverse postorder without recursion
+static void order(size_t root) {
+	size_t *stack = malloc(no_nodes * sizeof(*stack));
+	size_t *next = calloc(no_nodes, sizeof(*next));
+	char *seen = calloc(no_nodes, 1);
+	size_t *post = malloc(no_nodes * sizeof(*post));
+	size_t top = 0, no_post = 0;
+
+	stack[top++] = root;
+	seen[root] = 1;
+	while (top) {
+		size_t n = stack[top - 1];
+		if (next[n] < nodes[n].no_edges) {
+			size_t m = edges[nodes[n].edge + next[n]++];
+			if (m != SIZE_MAX && !seen[m]) {
+				seen[m] = 1;
+				stack[top++] = m;
+			}
+			continue;
+		}
+		post[no_post++] = n;
+		--top;
+	}
+
+	rpo = malloc(no_post * sizeof(*rpo));
+	no_rpo = no_post;
+	for (size_t i = 0;i < no_post;++i) {
+		size_t n = post[no_post - 1 - i];
+		rpo[i] = n;
+		nodes[n].order = i + 1;
+	}
+
+	free(stack);
+	free(next);
+	free(seen);
+	free(post);
+}
+
+static void predecessors(void) {
+	pred_start = calloc(no_nodes + 1, sizeof(*pred_start));
+	for (size_t e = 0;e < no_edges;++e) {
+		if (edges[e] != SIZE_MAX) {
+			pred_start[edges[e] + 1]++;
+		}
+	}
+	for (size_t i = 0;i < no_nodes;++i) {
+		pred_start[i + 1] += pred_start[i];
+	}
+
+	size_t *fill = malloc(no_nodes * sizeof(*fill));
+	memcpy(fill, pred_start, no_nodes * sizeof(*fill));
+	pred = malloc((no_edges + 1) * sizeof(*pred));
+	for (size_t n = 0;n < no_nodes;++n) {
+		for (size_t i = 0;i < nodes[n].no_edges;++i) {
+			size_t m = edges[nodes[n].edge + i];
+			if (m != SIZE_MAX) {
+				pred[fill[m]++] = n;
+			}
+		}
+	}
+	free(fill);
+}
+
+static size_t intersect(size_t a, size_t b) {
+	while (a != b) {
+		while (nodes[a].order > nodes[b].order) {
+			a = nodes[a].idom;
+		}
+		while (nodes[b].order > nodes[a].order) {
+			b = nodes[b].idom;
+		}
+	}
+	return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+static void dominators(size_t root) {
+	for (size_t i = 0;i < no_nodes;++i) {
+		nodes[i].idom = SIZE_MAX;
+	}
+	nodes[root].idom = root;
+
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (size_t i = 1;i < no_rpo;++i) {
+			size_t n = rpo[i];
+			size_t idom = SIZE_MAX;
+			for (size_t p = pred_start[n];p < pred_start[n + 1];++p) {
+				size_t m = pred[p];
+				if (nodes[m].idom == SIZE_MAX) {
+					continue;
+				}
+				idom = idom == SIZE_MAX ? m : intersect(m, idom);
+			}
+			if (nodes[n].idom != idom) {
+				nodes[n].idom = idom;
+				changed = 1;
+			}
+		}
+	}
+}
+
+typedef struct type_total {
+	char *type;
+	size_t count, bytes;
+} type_total;
+
+static size_t *sorted;
+
+static int retained_cmp(const void *a, const void *b) {
+	size_t x = nodes[*(size_t *)a].retained, y = nodes[*(size_t *)b].retained;
+	return (x < y) - (x > y);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <snapshot> [no objects]\n", argv[0]);
+		return 1;
+	}
+	size_t top = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+
+	FILE *in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "Unable to open %s!\n", argv[1]);
+		return 1;
+	}
+	int err = read_snapshot(in);
+	fclose(in);
+	if (err) {
+		return 1;
+	}
+
+	qsort(nodes, no_nodes, sizeof(*nodes), node_cmp);
+	size_t objects = no_nodes;
+	size_t root = add_root();
+	for (size_t e = 0;e < no_edges;++e) {
+		size_t m = find(edges[e]);
+		edges[e] = m < objects ? m : SIZE_MAX;
+	}
+
+	order(root);
+	predecessors();
+	dominators(root);
+
+	// Children always come after their dominator in reverse postorder
+	for (size_t i = no_rpo;i-- > 0;) {
+		size_t n = rpo[i];
+		nodes[n].retained += nodes[n].size;
+		if (n != root) {
+			nodes[nodes[n].idom].retained += nodes[n].retained;
+		}
+	}
+
+	size_t total = 0, unreachable = 0, unreachable_size = 0;
+	for (size_t i = 0;i < objects;++i) {
+		total += nodes[i].size;
+		if (!nodes[i].order) {
+			unreachable++;
+			unreachable_size += nodes[i].size;
+		}
+	}
+	printf("%zu objects, %zu bytes, %zu bytes reachable from %zu roots\n"
+			, objects, total, nodes[root].retained, no_roots);
+	if (unreachable) {
+		printf("%zu objects, %zu bytes awaiting collection\n", unreachable, unreachable_size);
+	}
+
+	type_total types[16];
+	size_t no_types = 0;
+	for (size_t i = 0;i < objects;++i) {
+		size_t t = 0;
+		while (t < no_types && strcmp(types[t].type, nodes[i].type)) {
+			++t;
+		}
+		if (t == no_types) {
+			if (no_types == sizeof(types) / sizeof(*types)) {
+				continue;
+			}
+			types[no_types++] = (type_total){nodes[i].type, 0, 0};
+		}
+		types[t].count++;
+		types[t].bytes += nodes[i].size;
+	}
+
+	printf("\n%-10s %8s %12s\n", "type", "count", "bytes");
+	for (size_t t = 0;t < no_types;++t) {
+		printf("%-10s %8zu %12zu\n", types[t].type, types[t].count, types[t].bytes);
+	}
+
+	sorted = malloc(no_rpo * sizeof(*sorted));
+	size_t no_sorted = 0;
+	for (size_t i = 0;i < no_rpo;++i) {
+		if (rpo[i] != root) {
+			sorted[no_sorted++] = rpo[i];
+		}
+	}
+	qsort(sorted, no_sorted, sizeof(*sorted), retained_cmp);
+
+	printf("\n%12s %10s %-10s %-16s %s\n", "retained", "self", "type", "id", "defined");
+	for (size_t i = 0;i < no_sorted && i < top;++i) {
+		node *n = &nodes[sorted[i]];
+		printf("%12zu %10zu %-10s %-16" PRIxPTR " %s\n", n->retained, n->size, n->type, n->id, n->loc);
+	}
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+// Times inserts and lookups in the two forms of the hash part of tables,
+// the val_ht every table starts with and the val_sw swiss table it moves to
+// past TAB_SWISS_MIN keys, at a range of sizes. Keys are doubles, as
+// integers would mostly go in the array part, and are looked up in a
+// shuffled order so that sizes past the cache show their misses
+//   ./ht_bench
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "../val.h"
+
+// Operations timed for each size and form
+#define BENCH_OPS 4000000
+
+static double now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void shuffle(val *v, size_t no) {
+	for (size_t i = no - 1;i > 0;--i) {
+		size_t j = rand() % (i + 1);
+		val t = v[i];
+		v[i] = v[j];
+		v[j] = t;
+	}
+}
+
+// Nanoseconds per insert, hit and miss into ns, found keeps the lookups
+// from being dropped
+#define BENCH_MAP(NAME) \
+static void bench_##NAME(val *keys, val *misses, size_t no, double *ns, size_t *found) { \
+	size_t reps = BENCH_OPS / no; \
+	NAME m = {0}; \
+	double start = now_ns(); \
+	for (size_t r = 0;r < reps;++r) { \
+		NAME##_free(&m); \
+		for (size_t i = 0;i < no;++i) { \
+			NAME##_set(&m, keys[i], keys[i]); \
+		} \
+	} \
+	ns[0] = (now_ns() - start) / (reps * no); \
+\
+	start = now_ns(); \
+	for (size_t r = 0;r < reps;++r) { \
+		for (size_t i = 0;i < no;++i) { \
+			*found += NAME##_find(&m, keys[i]) != NULL; \
+		} \
+	} \
+	ns[1] = (now_ns() - start) / (reps * no); \
+\
+	start = now_ns(); \
+	for (size_t r = 0;r < reps;++r) { \
+		for (size_t i = 0;i < no;++i) { \
+			*found += NAME##_find(&m, misses[i]) != NULL; \
+		} \
+	} \
+	ns[2] = (now_ns() - start) / (reps * no); \
+	NAME##_free(&m); \
+}
+
+BENCH_MAP(val_ht)
+BENCH_MAP(val_sw)
+
+int main(void) {
+	size_t sizes[] = {1000, 10000, 100000, 1000000};
+	size_t found = 0;
+
+	printf("%8s %16s %16s %16s   (ns per operation)\n", "keys", "insert ht/sw", "hit ht/sw", "miss ht/sw");
+	for (size_t s = 0;s < sizeof(sizes) / sizeof(*sizes);++s) {
+		size_t no = sizes[s];
+		val *keys = malloc(no * sizeof(val));
+		val *misses = malloc(no * sizeof(val));
+		for (size_t i = 0;i < no;++i) {
+			keys[i] = NUM_VAL(i + 0.5);
+			misses[i] = NUM_VAL(i + 0.25);
+		}
+		shuffle(keys, no);
+		shuffle(misses, no);
+
+		double ht[3], sw[3];
+		bench_val_ht(keys, misses, no, ht, &found);
+		bench_val_sw(keys, misses, no, sw, &found);
+		printf("%8zu %7.1f/%-8.1f %7.1f/%-8.1f %7.1f/%-8.1f\n", no, ht[0], sw[0], ht[1], sw[1], ht[2], sw[2]);
+
+		free(keys);
+		free(misses);
+	}
+
+	return found ? 0 : 1;
+}
@@ -1,19 +1,90 @@
 #ifndef NUA_VAL_H
 #define NUA_VAL_H
 
+#include <inttypes.h>
+
 #include "intern.h"
 #include "gc_types.h"
 
-typedef enum val_type { VAL_NIL, VAL_NUM, VAL_STR, VAL_FUNC, VAL_TAB, VAL_TYPE_NO } val_type;
-const char *val_type_str[VAL_TYPE_NO] = { "NIL", "NUM", "STR", "FUNC", "TAB" };
+// Numbers are either doubles or integers, see IS_NUMBER below. VAL_INT
+// must stay 5 for IS_INT2
+typedef enum val_type { VAL_NIL, VAL_NUM, VAL_STR, VAL_FUNC, VAL_TAB, VAL_INT, VAL_TYPE_NO } val_type;
+const char *val_type_str[VAL_TYPE_NO] = { "NIL", "NUM", "STR", "FUNC", "TAB", "INT" };
 
 struct tab;
 struct func;
+struct nua_state;
+
+// Values are only touched through the macros below, so that either
+// representation can be built:
+//   IS_<TYPE>(v)	test the type
+//   AS_<TYPE>(v)	unwrap, the type must already be known
+//   <TYPE>_VAL(x)	wrap, and NIL_VAL
+// Zeroed memory is nil in both
+#ifdef NUA_NAN_BOXING
+
+// A single word. Doubles are offset by 2^48 so their top 16 bits are never
+// zero, leaving those words for nil as 0 and for pointers, which are at
+// least 4 byte aligned, tagged with their type in the low 2 bits. Only NaNs
+// with a payload in the top bits would collide, and nothing makes those.
+// Integers take the top 16 bits being all set, so are limited to 48 bits
+typedef uint64_t val;
+
+#define VAL_NUM_OFFSET ((uint64_t)1 << 48)
+#define VAL_TAG_MASK (~(uint64_t)0 << 48 | 3)
+#define VAL_INT_TAG ((uint64_t)0xffff << 48)
+#define VAL_INT_MIN (-((int64_t)1 << 47))
+#define VAL_INT_MAX (((int64_t)1 << 47) - 1)
+
+static inline val val_from_num(double d) {
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return bits + VAL_NUM_OFFSET;
+}
+
+static inline double val_to_num(val v) {
+	uint64_t bits = v - VAL_NUM_OFFSET;
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+static inline val_type val_type_of(val v) {
+	if (v >> 48) {
+		return (v >> 48) == 0xffff ? VAL_INT : VAL_NUM;
+	}
+	return v ? (val_type)(VAL_STR + (v & 3) - 1) : VAL_NIL;
+}
+
+#define VAL_TYPE_OF(V) val_type_of(V)
+#define IS_NIL(V) ((V) == 0)
+#define IS_NUM(V) (((V) >> 48) - 1 < 0xfffe)
+#define IS_INT(V) (((V) >> 48) == 0xffff)
+#define IS_INT2(A, B) ((((A) & (B)) >> 48) == 0xffff)
+#define IS_STR(V) (((V) & VAL_TAG_MASK) == 1)
+#define IS_FUNC(V) (((V) & VAL_TAG_MASK) == 2)
+#define IS_TAB(V) (((V) & VAL_TAG_MASK) == 3)
+
+#define AS_NUM(V) val_to_num(V)
+#define AS_INT(V) ((int64_t)((V) << 16) >> 16)
+#define AS_STR(V) ((interned_str *)(uintptr_t)((V) & ~(uint64_t)3))
+#define AS_FUNC(V) ((struct func *)(uintptr_t)((V) & ~(uint64_t)3))
+#define AS_TAB(V) ((struct tab *)(uintptr_t)((V) & ~(uint64_t)3))
+
+#define NIL_VAL ((val)0)
+#define NUM_VAL(D) val_from_num(D)
+#define INT_VAL(I) (VAL_INT_TAG | ((uint64_t)(I) & ~VAL_INT_TAG))
+#define STR_VAL(P) ((val)(uintptr_t)(P) | 1)
+#define FUNC_VAL(P) ((val)(uintptr_t)(P) | 2)
+#define TAB_VAL(P) ((val)(uintptr_t)(P) | 3)
+
+#else
 
 typedef struct {
 	val_type type;
 	union {
 		double num;
+		int64_t i;
 		interned_str *str;
 		struct func *func;
 		struct tab *tab;
@@ -21,21 +92,181 @@ typedef struct {
 	};
 } val;
 
+#define VAL_TYPE_OF(V) ((V).type)
+#define IS_NIL(V) ((V).type == VAL_NIL)
+#define IS_NUM(V) ((V).type == VAL_NUM)
+#define IS_INT(V) ((V).type == VAL_INT)
+// Whether both are integers, no other pair of types has all the bits of
+// VAL_INT in common
+#define IS_INT2(A, B) (((A).type & (B).type) == VAL_INT)
+#define IS_STR(V) ((V).type == VAL_STR)
+#define IS_FUNC(V) ((V).type == VAL_FUNC)
+#define IS_TAB(V) ((V).type == VAL_TAB)
+
+#define AS_NUM(V) ((V).num)
+#define AS_INT(V) ((V).i)
+#define AS_STR(V) ((V).str)
+#define AS_FUNC(V) ((V).func)
+#define AS_TAB(V) ((V).tab)
+
+#define NIL_VAL ((val) {VAL_NIL})
+#define NUM_VAL(D) ((val) {VAL_NUM, .num = (D)})
+#define INT_VAL(I) ((val) {VAL_INT, .i = (I)})
+#define STR_VAL(P) ((val) {VAL_STR, .str = (P)})
+#define FUNC_VAL(P) ((val) {VAL_FUNC, .func = (P)})
+#define TAB_VAL(P) ((val) {VAL_TAB, .tab = (P)})
+
+#define VAL_INT_MIN INT64_MIN
+#define VAL_INT_MAX INT64_MAX
+
+#endif
+
+// Either subtype of number, AS_NUMBER gives it as a double
+#define IS_NUMBER(V) (IS_NUM(V) || IS_INT(V))
+#define AS_NUMBER(V) (IS_INT(V) ? (double)AS_INT(V) : AS_NUM(V))
+
+// Integer results outside the range of the subtype are left to doubles,
+// these give 0 for those
+static inline int int_add(int64_t a, int64_t b, int64_t *r) {
+#ifdef __GNUC__
+	if (__builtin_add_overflow(a, b, r)) {
+		return 0;
+	}
+#else
+	if (b > 0 ? a > INT64_MAX - b : a < INT64_MIN - b) {
+		return 0;
+	}
+	*r = a + b;
+#endif
+	return *r >= VAL_INT_MIN && *r <= VAL_INT_MAX;
+}
+
+static inline int int_sub(int64_t a, int64_t b, int64_t *r) {
+#ifdef __GNUC__
+	if (__builtin_sub_overflow(a, b, r)) {
+		return 0;
+	}
+#else
+	if (b < 0 ? a > INT64_MAX + b : a < INT64_MIN + b) {
+		return 0;
+	}
+	*r = a - b;
+#endif
+	return *r >= VAL_INT_MIN && *r <= VAL_INT_MAX;
+}
+
+// Without the builtin, products are first checked as doubles
+static inline int int_mul(int64_t a, int64_t b, int64_t *r) {
+#ifdef __GNUC__
+	if (__builtin_mul_overflow(a, b, r)) {
+		return 0;
+	}
+#else
+	double d = (double)a * (double)b;
+	if (d < -0x1p62 || d > 0x1p62) {
+		return 0;
+	}
+	*r = a * b;
+#endif
+	return *r >= VAL_INT_MIN && *r <= VAL_INT_MAX;
+}
+
+// Arithmetic and ordering of numbers, staying in integers while both
+// operands are. These give 0 when either operand is not a number
+static inline int num_add(val a, val b, val *r) {
+	int64_t i;
+	if (IS_INT2(a, b) && int_add(AS_INT(a), AS_INT(b), &i)) {
+		*r = INT_VAL(i);
+		return 1;
+	}
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		*r = NUM_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+		return 1;
+	}
+	return 0;
+}
+
+static inline int num_sub(val a, val b, val *r) {
+	int64_t i;
+	if (IS_INT2(a, b) && int_sub(AS_INT(a), AS_INT(b), &i)) {
+		*r = INT_VAL(i);
+		return 1;
+	}
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		*r = NUM_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+		return 1;
+	}
+	return 0;
+}
+
+static inline int num_mul(val a, val b, val *r) {
+	int64_t i;
+	if (IS_INT2(a, b) && int_mul(AS_INT(a), AS_INT(b), &i)) {
+		*r = INT_VAL(i);
+		return 1;
+	}
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		*r = NUM_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+		return 1;
+	}
+	return 0;
+}
+
+static inline int num_lt(val a, val b) {
+	if (IS_INT2(a, b)) {
+		return AS_INT(a) < AS_INT(b);
+	}
+	return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static inline int num_le(val a, val b) {
+	if (IS_INT2(a, b)) {
+		return AS_INT(a) <= AS_INT(b);
+	}
+	return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) <= AS_NUMBER(b);
+}
+
+// Whether a double holds exactly the integer
+static inline int num_is_int(double d, int64_t i) {
+	return d >= -0x1p63 && d < 0x1p63 && (int64_t)d == i && d == floor(d);
+}
+
+// Number hashes are mixed, the low bits of doubles and of small integers
+// hardly vary
+static inline uint64_t hash_mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
 static inline uint64_t val_hash(const val v) {
 	uint64_t hash = 0;
 
-	switch (v.type) {
-	case VAL_NUM:
-		memcpy(&hash, &v.num, (sizeof(v.num) > sizeof(hash)) ? sizeof(hash) : sizeof(v.num));
+	switch (VAL_TYPE_OF(v)) {
+	case VAL_NUM: {
+		double num = AS_NUM(v);
+		// Integral doubles hash as the integer, as they are equal keys
+		if (num == floor(num) && num >= -0x1p63 && num < 0x1p63) {
+			hash = hash_mix((uint64_t)(int64_t)num);
+			break;
+		}
+		memcpy(&hash, &num, (sizeof(num) > sizeof(hash)) ? sizeof(hash) : sizeof(num));
+		hash = hash_mix(hash);
+		break;
+	} case VAL_INT:
+		hash = hash_mix((uint64_t)AS_INT(v));
 		break;
 	case VAL_TAB:
-		hash = ((uintptr_t)(v.tab));
+		hash = ((uintptr_t)(AS_TAB(v)));
 		break;
 	case VAL_STR:
-		hash = ((uintptr_t)(v.str));
+		hash = ((uintptr_t)(AS_STR(v)));
 		break;
 	case VAL_FUNC:
-		hash = ((uintptr_t)(v.func));
+		hash = ((uintptr_t)(AS_FUNC(v)));
 		break;
 	default:
 		break;
@@ -46,68 +277,862 @@ static inline uint64_t val_hash(const val v) {
 }
 
 static inline int val_eq(const val a, const val b) {
-	switch (a.type) {
+	switch (VAL_TYPE_OF(a)) {
 	case VAL_NUM:
-		return (b.type == VAL_NUM) && a.num == b.num;
+		if (IS_INT(b)) {
+			return num_is_int(AS_NUM(a), AS_INT(b));
+		}
+		return IS_NUM(b) && AS_NUM(a) == AS_NUM(b);
+	case VAL_INT:
+		if (IS_NUM(b)) {
+			return num_is_int(AS_NUM(b), AS_INT(a));
+		}
+		return IS_INT(b) && AS_INT(a) == AS_INT(b);
 	case VAL_TAB:
-		return (b.type == VAL_TAB) && a.tab == b.tab;
+		return IS_TAB(b) && AS_TAB(a) == AS_TAB(b);
 	case VAL_STR:
-		return (b.type == VAL_STR) && a.str == b.str;
+		return IS_STR(b) && AS_STR(a) == AS_STR(b);
 	case VAL_FUNC:
-		return (b.type == VAL_FUNC) && a.func == b.func;
+		return IS_FUNC(b) && AS_FUNC(a) == AS_FUNC(b);
 	default:
 		return 0;
 	}
 }
 
-RH_HASH_MAKE(val_ht, val, val, val_hash, val_eq, 0.9)
+#define VAL_HT_LOAD 0.9
+RH_HASH_MAKE(val_ht, val, val, val_hash, val_eq, VAL_HT_LOAD)
+
+// Groups of control bytes are matched with SSE2 where there is one, define
+// NUA_NO_SIMD for the portable loop
+#if defined(__SSE2__) && !defined(NUA_NO_SIMD)
+#include <emmintrin.h>
+#define NUA_SW_SSE2
+#endif
+
+// A swiss table, for hash parts with many keys. Each slot has a control
+// byte, SW_EMPTY or otherwise the low 7 bits of the hash of its key, so a
+// lookup checks 16 slots at a time with one compare and only looks at the
+// keys whose bits match. Control bytes of the first group are repeated
+// past the end, so a group can start at any slot. Keys are never removed,
+// those set to nil stay until tab_hash_purge or a rehash builds the table
+// again, so there are no tombstones
+#define SW_GROUP 16
+#define SW_EMPTY ((int8_t)-128)
+
+typedef struct val_sw {
+	size_t mask;		// Slots - 1, slots being a power of 2
+	size_t no;
+	int8_t *ctrl;
+	val_ht_bucket *items;
+} val_sw;
+
+// Bit i is set where control byte i of the group equals c
+static inline unsigned sw_match(const int8_t *g, int8_t c) {
+#ifdef NUA_SW_SSE2
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)g), _mm_set1_epi8(c)));
+#else
+	unsigned bits = 0;
+	for (int i = 0;i < SW_GROUP;++i) {
+		bits |= (unsigned)(g[i] == c) << i;
+	}
+	return bits;
+#endif
+}
+
+static inline int sw_first(unsigned bits) {
+#ifdef __GNUC__
+	return __builtin_ctz(bits);
+#else
+	int i = 0;
+	while (!(bits & 1u << i)) {
+		++i;
+	}
+	return i;
+#endif
+}
+
+// Objects hash by address, which leaves the low bits the same
+static inline uint64_t sw_hash(val k) {
+	return hash_mix(val_hash(k));
+}
+
+// Groups are probed at triangular offsets, which reaches every group of a
+// power of 2 number of slots
+static val_ht_bucket *sw_find(val_sw *m, val k, uint64_t h) {
+	size_t pos = (h >> 7) & m->mask;
+#ifdef __GNUC__
+	// The key is most often near the start of the first group, fetching it
+	// alongside the control bytes saves waiting on one miss then the other
+	__builtin_prefetch(&m->items[pos]);
+#endif
+	for (size_t step = SW_GROUP;;step += SW_GROUP) {
+		for (unsigned bits = sw_match(m->ctrl + pos, h & 0x7f);bits;bits &= bits - 1) {
+			val_ht_bucket *b = &m->items[(pos + sw_first(bits)) & m->mask];
+			if (val_eq(b->key, k)) {
+				return b;
+			}
+		}
+		if (sw_match(m->ctrl + pos, SW_EMPTY)) {
+			return NULL;
+		}
+		pos = (pos + step) & m->mask;
+	}
+}
+
+// The key must not be in the table, and there must be room
+static void sw_insert(val_sw *m, val k, val v, uint64_t h) {
+	size_t pos = (h >> 7) & m->mask;
+	for (size_t step = SW_GROUP;;step += SW_GROUP) {
+		unsigned bits = sw_match(m->ctrl + pos, SW_EMPTY);
+		if (bits) {
+			size_t i = (pos + sw_first(bits)) & m->mask;
+			m->ctrl[i] = h & 0x7f;
+			if (i < SW_GROUP) {
+				m->ctrl[m->mask + 1 + i] = h & 0x7f;
+			}
+			m->items[i] = (val_ht_bucket) {k, v};
+			m->no++;
+			return;
+		}
+		pos = (pos + step) & m->mask;
+	}
+}
+
+static inline val_ht_bucket *val_sw_find(val_sw *m, val k) {
+	return m->items ? sw_find(m, k, sw_hash(k)) : NULL;
+}
+
+// Slots must be a power of 2 of at least SW_GROUP, with room for every key
+static void val_sw_resize(val_sw *m, size_t slots) {
+	val_sw old = *m;
+	m->mask = slots - 1;
+	m->no = 0;
+	m->ctrl = malloc(slots + SW_GROUP);
+	memset(m->ctrl, SW_EMPTY, slots + SW_GROUP);
+	m->items = malloc(slots * sizeof(val_ht_bucket));
+
+	for (size_t i = 0;old.items && i <= old.mask;++i) {
+		if (old.ctrl[i] != SW_EMPTY) {
+			sw_insert(m, old.items[i].key, old.items[i].value, sw_hash(old.items[i].key));
+		}
+	}
+	free(old.ctrl);
+	free(old.items);
+}
+
+// Kept at most 7/8 full
+static int val_sw_set(val_sw *m, val k, val v) {
+	uint64_t h = sw_hash(k);
+	val_ht_bucket *b = m->items ? sw_find(m, k, h) : NULL;
+	if (b) {
+		b->value = v;
+		return 0;
+	}
+
+	if (!m->items) {
+		val_sw_resize(m, SW_GROUP);
+	} else if ((m->no + 1) * 8 > (m->mask + 1) * 7) {
+		val_sw_resize(m, (m->mask + 1) * 2);
+	}
+	sw_insert(m, k, v, h);
+	return 0;
+}
+
+static inline void val_sw_free(val_sw *m) {
+	free(m->ctrl);
+	free(m->items);
+	*m = (val_sw) {0};
+}
+
+static val_sw val_sw_clone(val_sw *m) {
+	val_sw n = *m;
+	if (m->items) {
+		n.ctrl = memcpy(malloc(m->mask + 1 + SW_GROUP), m->ctrl, m->mask + 1 + SW_GROUP);
+		n.items = memcpy(malloc((m->mask + 1) * sizeof(val_ht_bucket)), m->items, (m->mask + 1) * sizeof(val_ht_bucket));
+	}
+	return n;
+}
+
+// The hash part of a table starts out as a val_ht, and becomes a val_sw
+// once it holds TAB_SWISS_MIN keys. Both keep their keys and values in
+// val_ht_bucket slots, which tab_hash_at gives for every slot in use
+#define TAB_SWISS_MIN 2048
+
+typedef struct tab_hash {
+	union {
+		val_ht rh;
+		val_sw sw;
+	};
+	int swiss;
+} tab_hash;
+
+static inline size_t tab_hash_slots(tab_hash *h) {
+	if (h->swiss) {
+		return h->sw.items ? h->sw.mask + 1 : 0;
+	}
+	return h->rh.items ? RH_HASH_SIZE(h->rh.size) : 0;
+}
+
+// Only for i below tab_hash_slots
+static inline val_ht_bucket *tab_hash_at(tab_hash *h, size_t i) {
+	if (h->swiss) {
+		return h->sw.ctrl[i] != SW_EMPTY ? &h->sw.items[i] : NULL;
+	}
+	return h->rh.hash[i] ? &h->rh.items[i] : NULL;
+}
+
+static inline size_t tab_hash_no(tab_hash *h) {
+	return h->swiss ? h->sw.no : h->rh.no;
+}
+
+static inline val_ht_bucket *tab_hash_items(tab_hash *h) {
+	return h->swiss ? h->sw.items : h->rh.items;
+}
+
+static inline val_ht_bucket *tab_hash_find(tab_hash *h, val k) {
+	return h->swiss ? val_sw_find(&h->sw, k) : val_ht_find(&h->rh, k);
+}
+
+static void tab_hash_set(tab_hash *h, val k, val v) {
+	if (h->swiss) {
+		val_sw_set(&h->sw, k, v);
+		return;
+	}
+
+	val_ht_set(&h->rh, k, v);
+	if (h->rh.no < TAB_SWISS_MIN) {
+		return;
+	}
+
+	// With room for twice as many keys
+	val_sw sw = {0};
+	size_t slots = SW_GROUP;
+	while (slots * 7 < h->rh.no * 8 * 2) {
+		slots *= 2;
+	}
+	val_sw_resize(&sw, slots);
+	for (size_t i = 0;i < RH_HASH_SIZE(h->rh.size);++i) {
+		if (h->rh.hash[i]) {
+			sw_insert(&sw, h->rh.items[i].key, h->rh.items[i].value, sw_hash(h->rh.items[i].key));
+		}
+	}
+	val_ht_free(&h->rh);
+	h->sw = sw;
+	h->swiss = 1;
+}
+
+// Whether adding a key would grow the table
+static inline int tab_hash_full(tab_hash *h) {
+	if (h->swiss) {
+		return h->sw.items && (h->sw.no + 1) * 8 > (h->sw.mask + 1) * 7;
+	}
+	return h->rh.items && h->rh.no + 1 > RH_HASH_SIZE(h->rh.size) * VAL_HT_LOAD;
+}
+
+// Keys set to nil, left in place
+static size_t tab_hash_dead(tab_hash *h) {
+	size_t dead = 0;
+	for (size_t i = 0;i < tab_hash_slots(h);++i) {
+		val_ht_bucket *b = tab_hash_at(h, i);
+		dead += b && IS_NIL(b->value);
+	}
+	return dead;
+}
+
+// Builds the table again without the keys set to nil, with as many slots
+static void tab_hash_purge(tab_hash *h) {
+	tab_hash c = {.swiss = h->swiss};
+	if (h->swiss) {
+		val_sw_resize(&c.sw, h->sw.mask + 1);
+	} else {
+		val_ht_resize(&c.rh, h->rh.size);
+	}
+
+	for (size_t i = 0;i < tab_hash_slots(h);++i) {
+		val_ht_bucket *b = tab_hash_at(h, i);
+		if (!b || IS_NIL(b->value)) {
+			continue;
+		}
+		if (c.swiss) {
+			sw_insert(&c.sw, b->key, b->value, sw_hash(b->key));
+		} else {
+			val_ht_set(&c.rh, b->key, b->value);
+		}
+	}
+	if (h->swiss) {
+		val_sw_free(&h->sw);
+	} else {
+		val_ht_free(&h->rh);
+	}
+	*h = c;
+}
+
+static inline void tab_hash_free(tab_hash *h) {
+	if (h->swiss) {
+		val_sw_free(&h->sw);
+	} else {
+		val_ht_free(&h->rh);
+	}
+	h->swiss = 0;
+}
+
+static inline tab_hash tab_hash_clone(tab_hash *h) {
+	tab_hash c = {.swiss = h->swiss};
+	if (h->swiss) {
+		c.sw = val_sw_clone(&h->sw);
+	} else {
+		c.rh = val_ht_clone(&h->rh);
+	}
+	return c;
+}
+
 RH_AL_MAKE(val_al, val)
+RH_AL_MAKE(int_al, int64_t)
+RH_AL_MAKE(num_al, double)
+
+// Stamps are unique across all tables and shapes, so a cache can never
+// match a table other than the one it was filled from, or one of the same
+// shape
+static uint64_t tab_layouts;
+
+// A shape holds the string keys of a table in the order they were added,
+// and is shared by every table given the same keys in the same order, so
+// tables only keep their values. Each shape adds one key to its parent, the
+// empty shape being NULL. Shapes are never freed, and hold on to keys only
+// by address, which tables with the shape keep alive
+#define SHAPE_MAX 64
+// The shapes of every state share one tree, so it stops growing at this
+// many shapes, and tables needing a new one past it become dicts instead
+#define SHAPE_TREE_MAX 16384
+// Shapes with more keys than this find them with a map rather than by
+// going through their parents
+#define SHAPE_LINEAR 8
+#define SHAPE_NO_SLOT SIZE_MAX
+
+static inline uint64_t shape_key_hash(interned_str *k) {
+	return hash_mix((uintptr_t)k);
+}
+
+static inline int shape_key_eq(interned_str *a, interned_str *b) {
+	return a == b;
+}
+
+struct shape;
+RH_HASH_MAKE(shape_map, interned_str *, struct shape *, shape_key_hash, shape_key_eq, 0.9)
+RH_HASH_MAKE(slot_map, interned_str *, size_t, shape_key_hash, shape_key_eq, 0.9)
+typedef struct shape {
+	struct shape *parent;
+	// Added by this shape, in slot no - 1
+	interned_str *key;
+	size_t no;
+	uint64_t layout;
+	// Shapes adding one more key
+	shape_map next;
+	// Every key, built on the first search past SHAPE_LINEAR
+	slot_map slots;
+} shape;
+
+static shape_map shape_roots;
+static size_t shape_count;
+
+// NULL once the tree is full
+static shape *shape_add(shape *s, interned_str *k) {
+	shape_map *next = s ? &s->next : &shape_roots;
+	shape_map_bucket *b = shape_map_find(next, k);
+	if (b) {
+		return b->value;
+	}
+	if (shape_count == SHAPE_TREE_MAX) {
+		return NULL;
+	}
+
+	shape_count++;
+	shape *c = malloc(sizeof(*c));
+	*c = (shape) {
+		.parent = s,
+		.key = k,
+		.no = s ? s->no + 1 : 1,
+		.layout = ++tab_layouts,
+	};
+	shape_map_set(next, k, c);
+	return c;
+}
+
+static size_t shape_find(shape *s, interned_str *k) {
+	if (s && s->no > SHAPE_LINEAR) {
+		if (!s->slots.no) {
+			for (shape *p = s;p;p = p->parent) {
+				slot_map_set(&s->slots, p->key, p->no - 1);
+			}
+		}
+		slot_map_bucket *b = slot_map_find(&s->slots, k);
+		return b ? b->value : SHAPE_NO_SLOT;
+	}
+
+	for (;s;s = s->parent) {
+		if (s->key == k) {
+			return s->no - 1;
+		}
+	}
+	return SHAPE_NO_SLOT;
+}
+
+// Room for slots grows in powers of 2
+static inline size_t shape_room(shape *s) {
+	size_t room = 4;
+	while (s && room < s->no) {
+		room *= 2;
+	}
+	return room;
+}
+
+// Array parts holding only integers, or only doubles, are kept unboxed in
+// ints or nums, which share top and size with al. Storing anything else,
+// nil included, boxes them into al for good. An empty table takes the kind
+// of the first value appended, whatever room it has being sized for vals
+typedef enum tab_kind { TAB_EMPTY, TAB_INTS, TAB_NUMS, TAB_VALS } tab_kind;
+
 typedef struct tab {
 	mem_block link;
-	val_al al;
-	val_ht ht;
+	union {
+		val_al al;
+		int_al ints;
+		num_al nums;
+	};
+	tab_kind kind;
+	tab_hash ht;
+	// Stamp for the positions of keys in ht, given out when first needed by
+	// an inline cache and cleared whenever keys may move
+	uint64_t layout;
+	// Literal whose al, ht and slots are shared, until the first write
+	struct tab *proto;
+	// String keys are kept in the shape with their values in slots, none of
+	// which are nil, until one is deleted or there are more than SHAPE_MAX.
+	// From then on dict is set and they go in ht like any other key
+	shape *shape;
+	val *slots;
+	int dict;
+	// Bytes of al, ht and slots counted in the heap's allocated
+	size_t storage;
 } tab;
 
-val tab_get(tab *t, val v) {
-	// Try to find in al first
-	if (v.type == VAL_NUM && v.num == floor(v.num) && v.num > 0) {
-		size_t ind = (size_t)v.num;
-		if (ind < t->al.top) {
-			val ret = t->al.items[ind];
-			if (ret.type != VAL_NIL) {
-				return ret;
-			}
+// Instances of a literal table start out sharing its storage
+static inline void tab_share(tab *t, tab *proto) {
+	t->al = proto->al;
+	t->kind = proto->kind;
+	t->ht = proto->ht;
+	t->shape = proto->shape;
+	t->slots = proto->slots;
+	t->dict = proto->dict;
+	t->proto = proto;
+}
+
+// Must come before any write to al, ht or slots. Keys stay where they
+// were, so the layout does too
+static inline void tab_own(tab *t) {
+	if (t->proto) {
+		switch (t->kind) {
+		case TAB_INTS:
+			t->ints = int_al_clone(&t->proto->ints);
+			break;
+		case TAB_NUMS:
+			t->nums = num_al_clone(&t->proto->nums);
+			break;
+		default:
+			t->al = val_al_clone(&t->proto->al);
+			break;
+		}
+		t->ht = tab_hash_clone(&t->proto->ht);
+		if (t->shape) {
+			size_t room = shape_room(t->shape) * sizeof(val);
+			t->slots = memcpy(malloc(room), t->proto->slots, room);
 		}
+		t->proto = NULL;
+	}
+}
+
+// Bytes of al, ht and slots owned by the table, none while they are shared
+static inline size_t tab_storage(tab *t) {
+	if (t->proto) {
+		return 0;
+	}
+
+	size_t size = t->al.size * (t->kind == TAB_INTS || t->kind == TAB_NUMS ? sizeof(double) : sizeof(val));
+	size_t buckets = tab_hash_slots(&t->ht);
+	if (t->ht.swiss) {
+		size += buckets ? buckets * (sizeof(val_ht_bucket) + 1) + SW_GROUP : 0;
+	} else {
+		size += buckets * (sizeof(val_ht_bucket) + sizeof(uint64_t));
+	}
+	if (t->shape) {
+		size += shape_room(t->shape) * sizeof(val);
+	}
+	return size;
+}
+
+// Returns 1 if there is no shape to add the key with
+static int tab_add_slot(tab *t, interned_str *k, val v) {
+	shape *s = shape_add(t->shape, k);
+	if (!s) {
+		return 1;
 	}
 
-	val_ht_bucket *b = val_ht_find(&t->ht, v);
+	size_t no = t->shape ? t->shape->no : 0;
+	if (!no) {
+		t->slots = malloc(shape_room(NULL) * sizeof(val));
+	} else if (no == shape_room(t->shape)) {
+		t->slots = realloc(t->slots, no * 2 * sizeof(val));
+	}
+	t->shape = s;
+	t->slots[no] = v;
+	return 0;
+}
+
+// Moves the string keys into ht for good
+static void tab_unshape(tab *t) {
+	for (shape *s = t->shape;s;s = s->parent) {
+		tab_hash_set(&t->ht, STR_VAL(s->key), t->slots[s->no - 1]);
+	}
+	free(t->slots);
+	t->slots = NULL;
+	t->shape = NULL;
+	t->dict = 1;
+	t->layout = 0;
+}
+
+static inline uint64_t tab_layout(tab *t) {
+	if (!t->layout) {
+		t->layout = ++tab_layouts;
+	}
+	return t->layout;
+}
+
+// Remembers where a constant key was found in the hash part of a table
+typedef struct tab_cache {
+	uint64_t layout;
+	size_t index;
+} tab_cache;
+
+// Integer keys below al.top are always kept in al, with nil for those that
+// are missing, and every other key in ht. Where the split lies is chosen
+// again each time ht grows, see tab_rehash
+#define TAB_NO_INDEX SIZE_MAX
+// Keys from here on are never moved into al
+#define TAB_MAX_ARRAY ((size_t)1 << 31)
+
+// Gives the position in al of an integral key, or TAB_NO_INDEX for any
+// other key
+static inline size_t tab_index(val k) {
+	if (IS_INT(k)) {
+		return AS_INT(k) >= 0 ? (size_t)AS_INT(k) : TAB_NO_INDEX;
+	}
+	if (IS_NUM(k) && AS_NUM(k) == floor(AS_NUM(k)) && AS_NUM(k) >= 0 && AS_NUM(k) < 0x1p63) {
+		return (size_t)AS_NUM(k);
+	}
+	return TAB_NO_INDEX;
+}
+
+// Smallest i with ind < 2^i
+static inline int tab_log2(size_t ind) {
+#ifdef __GNUC__
+	return ind ? 64 - __builtin_clzll(ind) : 0;
+#else
+	int i = 0;
+	while (ind >> i) {
+		++i;
+	}
+	return i;
+#endif
+}
+
+// Only for ind below al.top
+static inline val tab_al_get(tab *t, size_t ind) {
+	if (t->kind == TAB_INTS) {
+		return INT_VAL(t->ints.items[ind]);
+	}
+	if (t->kind == TAB_NUMS) {
+		return NUM_VAL(t->nums.items[ind]);
+	}
+	return t->al.items[ind];
+}
+
+static void tab_box(tab *t) {
+	if (t->kind == TAB_INTS || t->kind == TAB_NUMS) {
+		val *items = malloc((t->al.size ? t->al.size : 1) * sizeof(val));
+		for (size_t i = 0;i < t->al.top;++i) {
+			items[i] = tab_al_get(t, i);
+		}
+		free(t->al.items);
+		t->al.items = items;
+	}
+	t->kind = TAB_VALS;
+}
+
+static inline void tab_al_set(tab *t, size_t ind, val v) {
+	if (t->kind == TAB_INTS && IS_INT(v)) {
+		t->ints.items[ind] = AS_INT(v);
+	} else if (t->kind == TAB_NUMS && IS_NUM(v)) {
+		t->nums.items[ind] = AS_NUM(v);
+	} else {
+		if (t->kind != TAB_VALS) {
+			tab_box(t);
+		}
+		t->al.items[ind] = v;
+	}
+}
+
+static inline int tab_al_push(tab *t, val v) {
+	if (t->kind == TAB_EMPTY) {
+		t->kind = IS_INT(v) ? TAB_INTS : IS_NUM(v) ? TAB_NUMS : TAB_VALS;
+	}
+	if (t->kind == TAB_INTS && IS_INT(v)) {
+		return int_al_push(&t->ints, AS_INT(v));
+	}
+	if (t->kind == TAB_NUMS && IS_NUM(v)) {
+		return num_al_push(&t->nums, AS_NUM(v));
+	}
+	if (t->kind != TAB_VALS) {
+		tab_box(t);
+	}
+	return val_al_push(&t->al, v);
+}
+
+// Sizes al as the largest power of 2 that would be more than half full,
+// counting the integer keys in both parts, then moves keys across to match.
+// Dense ranges filled out of order end up in al, and an al left mostly
+// empty gives its keys back to ht
+static void tab_rehash(tab *t) {
+	// Keys by the power of 2 above them
+	size_t nums[33] = {0}, total = 0;
+	for (size_t i = 0;i < t->al.top;++i) {
+		if (t->kind != TAB_VALS || !IS_NIL(t->al.items[i])) {
+			nums[tab_log2(i)]++;
+			total++;
+		}
+	}
+	for (size_t i = 0;i < tab_hash_slots(&t->ht);++i) {
+		val_ht_bucket *b = tab_hash_at(&t->ht, i);
+		size_t ind;
+		if (b && !IS_NIL(b->value) && (ind = tab_index(b->key)) < TAB_MAX_ARRAY) {
+			nums[tab_log2(ind)]++;
+			total++;
+		}
+	}
+
+	size_t size = 0, below = 0;
+	for (int i = 0;i < 33 && total > ((size_t)1 << i) / 2;++i) {
+		below += nums[i];
+		if (below > ((size_t)1 << i) / 2) {
+			size = (size_t)1 << i;
+		}
+	}
+	if (size == t->al.top) {
+		return;
+	}
+
+	size_t old = t->al.top;
+	if (size > old) {
+		// Growing leaves nil in the gaps, shrinking keeps the kind
+		tab_box(t);
+		if (size > t->al.size) {
+			val_al_resize(&t->al, size);
+		}
+		for (size_t i = old;i < size;++i) {
+			t->al.items[i] = NIL_VAL;
+		}
+	}
+
+	tab_hash ht = {0};
+	for (size_t i = size;i < old;++i) {
+		val v = tab_al_get(t, i);
+		if (!IS_NIL(v)) {
+			tab_hash_set(&ht, INT_VAL(i), v);
+		}
+	}
+	t->al.top = size;
+
+	for (size_t i = 0;i < tab_hash_slots(&t->ht);++i) {
+		val_ht_bucket *b = tab_hash_at(&t->ht, i);
+		if (!b || IS_NIL(b->value)) {
+			continue;
+		}
+		size_t ind = tab_index(b->key);
+		if (ind < size) {
+			tab_al_set(t, ind, b->value);
+		} else {
+			tab_hash_set(&ht, b->key, b->value);
+		}
+	}
+	tab_hash_free(&t->ht);
+	t->ht = ht;
+	t->layout = 0;
+
+	if (size < old) {
+		switch (t->kind) {
+		case TAB_INTS:
+			int_al_resize(&t->ints, size);
+			break;
+		case TAB_NUMS:
+			num_al_resize(&t->nums, size);
+			break;
+		default:
+			val_al_resize(&t->al, size);
+			break;
+		}
+	}
+}
+
+val tab_get(tab *t, val k) {
+	size_t ind = tab_index(k);
+	if (ind < t->al.top) {
+		return tab_al_get(t, ind);
+	}
+	if (IS_STR(k) && !t->dict) {
+		ind = shape_find(t->shape, AS_STR(k));
+		return ind != SHAPE_NO_SLOT ? t->slots[ind] : NIL_VAL;
+	}
+
+	val_ht_bucket *b = tab_hash_find(&t->ht, k);
 	if (!b) {
-		return (val) {VAL_NIL};
+		return NIL_VAL;
 	}
 
 	return b->value;
 }
 
 int tab_set(tab *t, val k, val v) {
-	// Try to set in al first
-	if (k.type == VAL_NUM && k.num == floor(k.num) && k.num > 0) {
-		size_t ind = (size_t)k.num;
-		if (ind < t->al.top) {
-			t->al.items[ind] = v;
+	tab_own(t);
+
+	size_t ind = tab_index(k);
+	if (ind < t->al.top) {
+		tab_al_set(t, ind, v);
+		return 0;
+	}
+	if (IS_STR(k) && !t->dict) {
+		size_t slot = shape_find(t->shape, AS_STR(k));
+		if (slot != SHAPE_NO_SLOT && !IS_NIL(v)) {
+			t->slots[slot] = v;
 			return 0;
-		} else if (ind == t->al.top) {
-			return val_al_push(&t->al, v);
 		}
+		if (slot == SHAPE_NO_SLOT) {
+			if (IS_NIL(v)) {
+				return 0;
+			}
+			if ((!t->shape || t->shape->no < SHAPE_MAX) && !tab_add_slot(t, AS_STR(k), v)) {
+				return 0;
+			}
+		}
+		tab_unshape(t);
+	}
+
+	// Nil is never added to ht, and appends go to al rather than waiting
+	// for a rehash, both only if the key is not in ht already
+	if (ind == t->al.top || IS_NIL(v)) {
+		val_ht_bucket *b = tab_hash_no(&t->ht) ? tab_hash_find(&t->ht, k) : NULL;
+		if (b) {
+			b->value = v;
+			return 0;
+		}
+		if (IS_NIL(v)) {
+			return 0;
+		}
+
+		// Keys that now follow on are taken from ht, leaving nil behind
+		// until the next rehash or purge
+		tab_al_push(t, v);
+		while (tab_hash_no(&t->ht) && (b = tab_hash_find(&t->ht, INT_VAL(t->al.top))) && !IS_NIL(b->value)) {
+			tab_al_push(t, b->value);
+			b->value = NIL_VAL;
+		}
+		return 0;
+	}
+
+	// Rather than grow, keys set to nil make way once they are a quarter of
+	// those in ht, so keys coming and going do not grow it for good
+	if (tab_hash_full(&t->ht) && tab_hash_dead(&t->ht) * 4 >= tab_hash_no(&t->ht)) {
+		tab_hash_purge(&t->ht);
+		t->layout = 0;
 	}
 
-	val_ht_set(&t->ht, k, v);
+	val_ht_bucket *items = tab_hash_items(&t->ht);
+	size_t no = tab_hash_no(&t->ht), slots = tab_hash_slots(&t->ht);
+	tab_hash_set(&t->ht, k, v);
+
+	// Adding a key or growing can move the others
+	if (tab_hash_no(&t->ht) != no || tab_hash_items(&t->ht) != items) {
+		t->layout = 0;
+	}
+	if (ind != TAB_NO_INDEX && slots && tab_hash_slots(&t->ht) != slots) {
+		tab_rehash(t);
+	}
 	return 0;
 }
 
+// The cached forms are for string keys, so are only ever in the slots or
+// the hash part
+static inline val tab_get_cached(tab *t, val k, tab_cache *c) {
+	if (!t->dict) {
+		if (t->shape && t->shape->layout == c->layout) {
+			return t->slots[c->index];
+		}
+
+		size_t slot = shape_find(t->shape, AS_STR(k));
+		if (slot == SHAPE_NO_SLOT) {
+			return NIL_VAL;
+		}
+
+		*c = (tab_cache) {t->shape->layout, slot};
+		return t->slots[slot];
+	}
+
+	if (t->layout && t->layout == c->layout) {
+		return tab_hash_items(&t->ht)[c->index].value;
+	}
+
+	val_ht_bucket *b = tab_hash_find(&t->ht, k);
+	if (!b) {
+		return NIL_VAL;
+	}
+
+	*c = (tab_cache) {tab_layout(t), b - tab_hash_items(&t->ht)};
+	return b->value;
+}
+
+// Returns 1 where the table may have taken more storage, 0 if the value
+// was stored in place
+static inline int tab_set_cached(tab *t, val k, val v, tab_cache *c) {
+	int owned = t->proto != NULL;
+	tab_own(t);
+	if (!t->dict && t->shape && t->shape->layout == c->layout && !IS_NIL(v)) {
+		t->slots[c->index] = v;
+		return owned;
+	}
+	if (t->dict && t->layout && t->layout == c->layout) {
+		tab_hash_items(&t->ht)[c->index].value = v;
+		return owned;
+	}
+
+	tab_set(t, k, v);
+	if (!t->dict) {
+		size_t slot = shape_find(t->shape, AS_STR(k));
+		if (slot != SHAPE_NO_SLOT) {
+			*c = (tab_cache) {t->shape->layout, slot};
+		}
+		return 1;
+	}
+	val_ht_bucket *b = tab_hash_find(&t->ht, k);
+	if (b) {
+		*c = (tab_cache) {tab_layout(t), b - tab_hash_items(&t->ht)};
+	}
+	return 1;
+}
+
+// Appends to al, for tables being built that have no integer keys in ht
 static inline int tab_push(tab *t, val v) {
-	return val_al_push(&t->al, v);
+	tab_own(t);
+	return tab_al_push(t, v);
 }
-typedef enum optype { OPT_N, OPT_RU, OPT_R, OPT_RR, OPT_RRR, OPT_O } optype;
+typedef enum optype { OPT_N, OPT_RU, OPT_R, OPT_RR, OPT_RRR, OPT_RRK, OPT_O, OPT_RO } optype;
 
 #define OPCODES\
 	I(NOP,    N),\
@@ -119,15 +1144,42 @@ typedef enum optype { OPT_N, OPT_RU, OPT_R, OPT_RR, OPT_RRR, OPT_O } optype;
 	I(SUB,    RRR),\
 	I(GT,     RRR),\
 	I(GE,     RRR),\
+	I(TGT,    RRR),\
+	I(TGE,    RRR),\
+	I(ADDK,   RRK),\
+	I(SUBK,   RRK),\
+	I(GTK,    RRK),\
+	I(GEK,    RRK),\
+	I(LTK,    RRK),\
+	I(LEK,    RRK),\
+	I(TGTK,   RRK),\
+	I(TGEK,   RRK),\
+	I(TLTK,   RRK),\
+	I(TLEK,   RRK),\
 	I(MOV,    RR),\
 	I(TAB,    R),\
 	I(GTAB,   RRR),\
 	I(STAB,   RRR),\
 	I(PTAB,   RR),\
+	I(GETF,   RRK),\
+	I(SETF,   RRK),\
 	I(CALL,   RRR),\
+	I(TAILCALL, RRR),\
 	I(RET,    RRR),\
 	I(SENV,   RU),\
-	I(GENV,   RU),
+	I(GENV,   RU),\
+	I(FORPREP, RO),\
+	I(FORLOOP, RO),\
+	I(ADD_II, RRR),\
+	I(ADD_NN, RRR),\
+	I(SUB_II, RRR),\
+	I(SUB_NN, RRR),\
+	I(ADDK_II, RRK),\
+	I(ADDK_NN, RRK),\
+	I(SUBK_II, RRK),\
+	I(SUBK_NN, RRK),\
+	I(GTAB_I, RRR),\
+	I(STAB_I, RRR),
 
 typedef enum opcode {
 #define I(OPCODE, ...) OP_##OPCODE
@@ -155,10 +1207,36 @@ int op_retarget[OPCODE_NO] = {
 	[OP_SUB] = 1,
 	[OP_GT] = 1,
 	[OP_GE] = 1,
+	[OP_ADDK] = 1,
+	[OP_SUBK] = 1,
+	[OP_GTK] = 1,
+	[OP_GEK] = 1,
+	[OP_LTK] = 1,
+	[OP_LEK] = 1,
 	[OP_MOV] = 1,
 	[OP_TAB] = 1,
 };
 
+// Quickened ops are never emitted, the interpreter rewrites an op in place
+// into one once it has seen the types of its operands, and back on a miss.
+// _II for integers, _NN for doubles, _I for integer keys of the array part
+int op_generic[OPCODE_NO] = {
+	[OP_ADD_II] = OP_ADD,
+	[OP_ADD_NN] = OP_ADD,
+	[OP_SUB_II] = OP_SUB,
+	[OP_SUB_NN] = OP_SUB,
+	[OP_ADDK_II] = OP_ADDK,
+	[OP_ADDK_NN] = OP_ADDK,
+	[OP_SUBK_II] = OP_SUBK,
+	[OP_SUBK_NN] = OP_SUBK,
+	[OP_GTAB_I] = OP_GTAB,
+	[OP_STAB_I] = OP_STAB,
+};
+
+static inline int op_base(int op) {
+	return op_generic[op] ? op_generic[op] : op;
+}
+
 typedef struct inst {
 	uint8_t op;
 	union {
@@ -185,6 +1263,17 @@ RH_AL_MAKE(inst_list, inst)
 RH_AL_MAKE(inst_lines, int)
 RH_HASH_MAKE(loc_map, char *, size_t, rh_string_hash, rh_string_eq, 0.9)
 
+// Functions that get hot are compiled to native code, see jit.h. Define
+// NUA_NO_JIT to only ever interpret
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NUA_NO_JIT)
+#define NUA_JIT
+#endif
+
+struct jit_code;
+#ifdef NUA_JIT
+void jit_free(struct jit_code *j);
+#endif
+
 typedef struct func_def {
 	mem_block link;
 
@@ -195,6 +1284,12 @@ typedef struct func_def {
 	// Code
 	inst_list ins;
 	val_al literals;
+	tab_cache *cache;	// One per instruction, used by those with a constant key
+	uint8_t *misses;	// Of quickened forms, per instruction
+
+	// Native code
+	int hot;		// Calls and loop iterations so far, -1 once compiled
+	struct jit_code *jit;
 
 	// Debug data
 	const char *file;
@@ -215,7 +1310,7 @@ typedef struct func {
 		};
 		struct {
 			// TODO Real c function type
-			int (*c_func)(int no_args, val *stack);
+			int (*c_func)(struct nua_state *n, int no_args, val *stack);
 		};
 	};
 } func;
@@ -225,7 +1320,7 @@ int print_val(val v);
 int print_literals(func_def f) {
 	printf("literals for func def [%s;%d,%d]\n", f.file, f.lines.items[0], inst_lines_peek(&f.lines));
 	for (size_t i = 0;i < f.literals.top;++i) {
-		printf("%zu| %s; ", i, val_type_str[f.literals.items[i].type]);
+		printf("%zu| %s; ", i, val_type_str[VAL_TYPE_OF(f.literals.items[i])]);
 		print_val(f.literals.items[i]);
 	}
 	return 0;
@@ -249,9 +1344,15 @@ void print_inst(inst i) {
 	case OPT_RRR:
 		printf("%d, %d, %d\n", i.rout, i.rina, i.rinb);
 		break;
+	case OPT_RRK:
+		printf("%d, %d, k%d\n", i.rout, i.rina, i.rinb);
+		break;
 	case OPT_O:
 		printf("%d\n", i.off);
 		break;
+	case OPT_RO:
+		printf("%d, %d\n", i._reg, i.ilit);
+		break;
 	}
 }
 
@@ -267,16 +1368,19 @@ int print_func_def(func_def f) {
 }
 
 int print_val(val v) {
-	switch (v.type) {
+	switch (VAL_TYPE_OF(v)) {
 	case VAL_NUM:
-		printf("%f\n", v.num);
+		printf("%f\n", AS_NUM(v));
+		break;
+	case VAL_INT:
+		printf("%" PRId64 "\n", AS_INT(v));
 		break;
 	case VAL_FUNC:
-		switch (v.func->type) {
+		switch (AS_FUNC(v)->type) {
 		case FUNC_NUA:
 			puts("FUNC_NUA:");
 			puts("{");
-			print_func_def(*v.func->def);
+			print_func_def(*AS_FUNC(v)->def);
 			puts("}");
 			break;
 		case FUNC_C:
@@ -289,25 +1393,30 @@ int print_val(val v) {
 	case VAL_TAB:
 		puts("{");
 		puts("AL:");
-		for (size_t i = 0;i < v.tab->al.top;++i) {
+		for (size_t i = 0;i < AS_TAB(v)->al.top;++i) {
 			printf("%zu;", i);
-			print_val(v.tab->al.items[i]);
+			print_val(tab_al_get(AS_TAB(v), i));
 		}
 		puts("Hash:");
-		if (v.tab->ht.items) {
-			for (size_t i = 0;i < RH_HASH_SIZE(v.tab->ht.size);++i) {
-				if (!v.tab->ht.hash[i]) {
-					continue;
-				}
-				print_val(v.tab->ht.items[i].key);
-				printf("= ");
-				print_val(v.tab->ht.items[i].value);
+		for (size_t i = 0;i < tab_hash_slots(&AS_TAB(v)->ht);++i) {
+			val_ht_bucket *b = tab_hash_at(&AS_TAB(v)->ht, i);
+			// Keys left with nil are only waiting for a rehash
+			if (!b || IS_NIL(b->value)) {
+				continue;
 			}
+			print_val(b->key);
+			printf("= ");
+			print_val(b->value);
+		}
+		for (shape *s = AS_TAB(v)->shape;s;s = s->parent) {
+			print_val(STR_VAL(s->key));
+			printf("= ");
+			print_val(AS_TAB(v)->slots[s->no - 1]);
 		}
 		puts("}");
 		break;
 	default:
-		puts(val_type_str[v.type]);
+		puts(val_type_str[VAL_TYPE_OF(v)]);
 		break;
 	}
 